@@ -0,0 +1,232 @@
+// bench.c — end-to-end load generator for the DSS (manager + disks + users on loopback)
+// Build:   make bench
+// Run:     ./bench [--disks=N] [--users=U] [--secs=S | --ops=N] [--mix=register:1,ls:2,copy:1,read:4]
+//                  [--size=<bytes>] [--su=<bytes>] [--workers=N] [--port=P] [--out=<file>] [--bin=<dir>]
+// setup:   starts ./manager (--quiet) and N ./disk processes from --bin (default: this binary's
+//          directory), then U ./user children, each a simulated user on its own ports with its
+//          own stdin/stdout pipes. one configures DSS "bench" over all disks, every user copies
+//          its --size-byte source file once (untimed) so reads have something to fetch
+// load:    one thread per user picks ops from the weighted mix until --secs (default 10) or
+//          --ops per user run out. an op is the command plus "sync" (user prints SYNC once
+//          its pipeline is drained), so latency is end to end as the user sees it; an op fails
+//          when any of its reply lines starts with FAILURE
+// output:  a table per command (count, failures, ops/s, MB/s, p50/p99/p999 ms) on stdout and,
+//          with --out (default bench.json), the same as one JSON object tagged with the git
+//          commit, so runs on different commits can be diffed
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define USERS_MAX 256
+#define DISKS_MAX 64
+enum { OP_REGISTER, OP_LS, OP_COPY, OP_READ, NOPS };
+static const char *op_name[NOPS]={"register","ls","copy","read"};
+
+static double now_sec(void){ struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts); return ts.tv_sec+ts.tv_nsec/1e9; }
+
+// latencies of one op kind on one thread (merged after the run)
+typedef struct { double *lat; int n, cap, fail; long long bytes; } Samples;
+static void sample_add(Samples *s, double v){
+    if(s->n==s->cap){ s->cap=s->cap?s->cap*2:1024; double *t=realloc(s->lat,(size_t)s->cap*sizeof(double)); if(!t){ perror("realloc"); exit(1); } s->lat=t; }
+    s->lat[s->n++]=v;
+}
+
+typedef struct {
+    int id; pid_t pid; FILE *in, *out;  // the user child's stdin / stdout
+    char name[32], src[PATH_MAX];
+    unsigned seed; int nregs;
+    Samples st[NOPS];
+} Sim;
+
+static struct {
+    int disks, users, workers, port; double secs; long ops; long long size; int su;
+    int weight[NOPS], wsum; const char *out; char bin[PATH_MAX], dir[64];
+} cfg={ .disks=4, .users=8, .workers=2, .port=9700, .secs=10, .size=1<<20, .su=65536, .weight={1,2,1,4}, .out="bench.json" };
+
+static pid_t spawn(char *const argv[], int *to, int *from){
+    int pi[2]={-1,-1}, po[2]={-1,-1};
+    if((to&&pipe2(pi,O_CLOEXEC)<0)||(from&&pipe2(po,O_CLOEXEC)<0)){ perror("pipe"); exit(1); }
+    pid_t p=fork(); if(p<0){ perror("fork"); exit(1); }
+    if(!p){
+        int null=open("/dev/null",O_RDWR);
+        dup2(to?pi[0]:null,0); dup2(from?po[1]:null,1); dup2(null,2);
+        execv(argv[0],argv); _exit(127);
+    }
+    if(to){ close(pi[0]); *to=pi[1]; }
+    if(from){ close(po[1]); *from=po[0]; }
+    return p;
+}
+
+// one command through a simulated user: its latency, and whether no line failed (-1 = user gone)
+static int sim_run(Sim *u, const char *cmd, double *lat){
+    double t0=now_sec();
+    if(fprintf(u->in,"%s\nsync\n",cmd)<0||fflush(u->in)) return -1;
+    char *line=NULL; size_t cap=0; int ok=1;
+    for(;;){
+        if(getline(&line,&cap,u->out)<0){ free(line); return -1; }
+        if(!strcmp(line,"SYNC\n")) break;
+        if(!strncmp(line,"FAILURE",7)) ok=0;
+    }
+    *lat=now_sec()-t0; free(line); return ok;
+}
+
+static int pick(unsigned *seed){
+    int r=(int)(rand_r(seed)%(unsigned)cfg.wsum);
+    for(int k=0;k<NOPS;k++){ if(r<cfg.weight[k]) return k; r-=cfg.weight[k]; }
+    return NOPS-1;
+}
+
+static double t_end;
+static void* sim_loop(void *arg){
+    Sim *u=arg; char cmd[PATH_MAX+128];
+    for(long i=0;cfg.ops?i<cfg.ops:now_sec()<t_end;i++){
+        int op=pick(&u->seed); long long bytes=0;
+        switch(op){
+        case OP_REGISTER: snprintf(cmd,sizeof(cmd),"register-user %s_r%d 127.0.0.1 %d %d",u->name,u->nregs++,cfg.port+1000,cfg.port+1001); break;
+        case OP_LS: snprintf(cmd,sizeof(cmd),"ls dss=bench limit=128"); break;
+        case OP_COPY: snprintf(cmd,sizeof(cmd),"copy file=%s dss=bench",u->src); bytes=cfg.size; break;
+        default: snprintf(cmd,sizeof(cmd),"read file=%s dss=bench out=/dev/null",strrchr(u->src,'/')+1); bytes=cfg.size; break;
+        }
+        double lat; int ok=sim_run(u,cmd,&lat);
+        if(ok<0){ fprintf(stderr,"bench: user %s exited\n",u->name); break; }
+        sample_add(&u->st[op],lat);
+        if(ok) u->st[op].bytes+=bytes; else u->st[op].fail++;
+    }
+    return NULL;
+}
+
+static int dcmp(const void *a, const void *b){ double x=*(const double*)a, y=*(const double*)b; return (x>y)-(x<y); }
+static double pct(const double *v, int n, double p){ if(!n) return 0; int i=(int)(p*n); return v[i<n?i:n-1]; }
+
+static int parse_mix(const char *s){
+    memset(cfg.weight,0,sizeof(cfg.weight));
+    for(const char *p=s;*p;){
+        size_t k=strcspn(p,":"); int hit=-1;
+        for(int o=0;o<NOPS;o++) if(strlen(op_name[o])==k&&!strncmp(p,op_name[o],k)) hit=o;
+        if(hit<0||p[k]!=':') return -1;
+        cfg.weight[hit]=atoi(p+k+1); p+=k+1; p+=strcspn(p,","); if(*p) p++;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    setvbuf(stdout,NULL,_IONBF,0); signal(SIGPIPE,SIG_IGN);
+    char self[PATH_MAX]; ssize_t sl=readlink("/proc/self/exe",self,sizeof(self)-1);
+    snprintf(cfg.bin,sizeof(cfg.bin),"%s",sl>0?(self[sl]='\0',dirname(self)):".");
+    for(int i=1;i<argc;i++){
+        const char *a=argv[i];
+        if(!strncmp(a,"--disks=",8)) cfg.disks=atoi(a+8);
+        else if(!strncmp(a,"--users=",8)) cfg.users=atoi(a+8);
+        else if(!strncmp(a,"--secs=",7)) cfg.secs=atof(a+7);
+        else if(!strncmp(a,"--ops=",6)) cfg.ops=atol(a+6);
+        else if(!strncmp(a,"--size=",7)) cfg.size=atoll(a+7);
+        else if(!strncmp(a,"--su=",5)) cfg.su=atoi(a+5);
+        else if(!strncmp(a,"--workers=",10)) cfg.workers=atoi(a+10);
+        else if(!strncmp(a,"--port=",7)) cfg.port=atoi(a+7);
+        else if(!strncmp(a,"--out=",6)) cfg.out=a+6;
+        else if(!strncmp(a,"--bin=",6)) snprintf(cfg.bin,sizeof(cfg.bin),"%s",a+6);
+        else if(!strncmp(a,"--mix=",6)){ if(parse_mix(a+6)<0){ fprintf(stderr,"bad mix: %s\n",a+6); return 1; } }
+        else{ fprintf(stderr,"usage: bench [--disks=N] [--users=U] [--secs=S|--ops=N] [--mix=register:1,ls:2,copy:1,read:4] [--size=<bytes>] [--su=<bytes>] [--workers=N] [--port=P] [--out=<file>] [--bin=<dir>]\n"); return 1; }
+    }
+    cfg.wsum=0; for(int o=0;o<NOPS;o++) cfg.wsum+=cfg.weight[o]>0?cfg.weight[o]:0;
+    if(cfg.disks<3||cfg.disks>DISKS_MAX||cfg.users<1||cfg.users>USERS_MAX||cfg.size<1||cfg.su<1||cfg.wsum<=0||cfg.port<=0||cfg.port+2*(USERS_MAX+DISKS_MAX)+2>65535){
+        fprintf(stderr,"bench: need 3..%d disks, 1..%d users, size/su > 0, a non-empty mix and a usable port\n",DISKS_MAX,USERS_MAX); return 1;
+    }
+
+    // source files, one per user (so copies don't contend for one file's lease)
+    snprintf(cfg.dir,sizeof(cfg.dir),"/tmp/dss-bench-%d",(int)getpid());
+    if(mkdir(cfg.dir,0755)<0){ perror(cfg.dir); return 1; }
+    static Sim sims[USERS_MAX];
+    char *blk=malloc(1<<16); if(!blk){ perror("malloc"); return 1; }
+    for(int i=0;i<cfg.users;i++){
+        Sim *u=&sims[i]; u->id=i; u->seed=(unsigned)i*2654435761u+1u; snprintf(u->name,sizeof(u->name),"bu%d",i);
+        snprintf(u->src,sizeof(u->src),"%s/%s.bin",cfg.dir,u->name);
+        FILE *f=fopen(u->src,"w"); if(!f){ perror(u->src); return 1; }
+        for(long long w=0;w<cfg.size;){ size_t n=(size_t)(cfg.size-w<(1<<16)?cfg.size-w:(1<<16)); for(size_t k=0;k<n;k++) blk[k]=(char)rand_r(&u->seed); fwrite(blk,1,n,f); w+=(long long)n; }
+        fclose(f);
+    }
+    free(blk);
+
+    // cluster: manager on port, disk i on port+1+2i/+2+2i, user i on port+2*DISKS_MAX+1+2i/+2
+    char path[PATH_MAX+16], a1[32], a2[32], a3[32], a4[32];
+    snprintf(path,sizeof(path),"%s/manager",cfg.bin); snprintf(a1,sizeof(a1),"%d",cfg.port); snprintf(a2,sizeof(a2),"--workers=%d",cfg.workers);
+    pid_t mpid=spawn((char*[]){path,a1,a2,"--quiet",NULL},NULL,NULL);
+    usleep(200000);
+    pid_t dpid[DISKS_MAX]; int dstdin[DISKS_MAX];
+    snprintf(path,sizeof(path),"%s/disk",cfg.bin);
+    for(int i=0;i<cfg.disks;i++){
+        char nm[16]; snprintf(nm,sizeof(nm),"bd%d",i); snprintf(a3,sizeof(a3),"%d",cfg.port+1+2*i); snprintf(a4,sizeof(a4),"%d",cfg.port+2+2*i);
+        dpid[i]=spawn((char*[]){path,nm,"127.0.0.1",a1,a3,a4,NULL},&dstdin[i],NULL);
+    }
+    usleep(300000);
+    snprintf(path,sizeof(path),"%s/user",cfg.bin);
+    int rc=0; double lat;
+    for(int i=0;i<cfg.users&&!rc;i++){
+        Sim *u=&sims[i]; int to,from;
+        snprintf(a3,sizeof(a3),"%d",cfg.port+2*DISKS_MAX+1+2*i); snprintf(a4,sizeof(a4),"%d",cfg.port+2*DISKS_MAX+2+2*i);
+        u->pid=spawn((char*[]){path,u->name,"127.0.0.1",a1,a3,a4,NULL},&to,&from);
+        u->in=fdopen(to,"w"); u->out=fdopen(from,"r");
+        if(sim_run(u,"",&lat)<0){ fprintf(stderr,"bench: user %s did not start\n",u->name); rc=1; }
+    }
+    char cmd[PATH_MAX+64];
+    snprintf(cmd,sizeof(cmd),"configure-dss bench %d %d",cfg.disks,cfg.su);
+    if(!rc&&sim_run(&sims[0],cmd,&lat)!=1){ fprintf(stderr,"bench: configure-dss failed\n"); rc=1; }
+    for(int i=0;i<cfg.users&&!rc;i++){
+        snprintf(cmd,sizeof(cmd),"copy file=%s dss=bench",sims[i].src);
+        if(sim_run(&sims[i],cmd,&lat)!=1){ fprintf(stderr,"bench: initial copy for %s failed\n",sims[i].name); rc=1; }
+    }
+
+    // timed run
+    double t0=now_sec(), el=0;
+    if(!rc){
+        printf("bench: %d disks, %d users, %s %g, mix register:%d ls:%d copy:%d read:%d, %lld-byte files, su %d\n",cfg.disks,cfg.users,cfg.ops?"ops/user":"secs",cfg.ops?(double)cfg.ops:cfg.secs,cfg.weight[0],cfg.weight[1],cfg.weight[2],cfg.weight[3],cfg.size,cfg.su);
+        t_end=t0+cfg.secs;
+        pthread_t th[USERS_MAX];
+        for(int i=0;i<cfg.users;i++) pthread_create(&th[i],NULL,sim_loop,&sims[i]);
+        for(int i=0;i<cfg.users;i++) pthread_join(th[i],NULL);
+        el=now_sec()-t0;
+    }
+
+    // tear down: users and disks see EOF on stdin, the manager is signalled
+    for(int i=0;i<cfg.users;i++) if(sims[i].pid>0){ fclose(sims[i].in); fclose(sims[i].out); }
+    for(int i=0;i<cfg.disks;i++){ close(dstdin[i]); kill(dpid[i],SIGTERM); }
+    kill(mpid,SIGTERM);
+    while(wait(NULL)>0||errno==EINTR);
+    for(int i=0;i<cfg.users;i++) unlink(sims[i].src);
+    rmdir(cfg.dir);
+    if(rc) return rc;
+
+    // merge and report
+    char commit[64]="unknown"; FILE *g=popen("git rev-parse --short HEAD 2>/dev/null","r");
+    if(g){ if(fgets(commit,sizeof(commit),g)) commit[strcspn(commit,"\n")]='\0'; else snprintf(commit,sizeof(commit),"unknown"); pclose(g); }
+    FILE *js=cfg.out[0]?fopen(cfg.out,"w"):NULL;
+    if(cfg.out[0]&&!js) perror(cfg.out);
+    if(js) fprintf(js,"{\"commit\":\"%s\",\"time\":%ld,\"disks\":%d,\"users\":%d,\"workers\":%d,\"size\":%lld,\"su\":%d,\"secs\":%.3f,\"ops\":{",commit,(long)time(NULL),cfg.disks,cfg.users,cfg.workers,cfg.size,cfg.su,el);
+    printf("%-9s %8s %6s %10s %9s %9s %9s %9s\n","op","count","fail","ops/s","MB/s","p50_ms","p99_ms","p999_ms");
+    long total=0; int first=1;
+    for(int o=0;o<NOPS;o++){
+        Samples m={0};
+        for(int i=0;i<cfg.users;i++){ Samples *s=&sims[i].st[o]; for(int k=0;k<s->n;k++) sample_add(&m,s->lat[k]); m.fail+=s->fail; m.bytes+=s->bytes; free(s->lat); }
+        if(!m.n) continue;
+        qsort(m.lat,(size_t)m.n,sizeof(double),dcmp); total+=m.n;
+        double ops=m.n/el, mbs=m.bytes/el/1e6, p50=pct(m.lat,m.n,0.5)*1e3, p99=pct(m.lat,m.n,0.99)*1e3, p999=pct(m.lat,m.n,0.999)*1e3;
+        printf("%-9s %8d %6d %10.1f %9.1f %9.3f %9.3f %9.3f\n",op_name[o],m.n,m.fail,ops,mbs,p50,p99,p999);
+        if(js) fprintf(js,"%s\"%s\":{\"count\":%d,\"fail\":%d,\"ops_per_sec\":%.2f,\"mb_per_sec\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f}",first?"":",",op_name[o],m.n,m.fail,ops,mbs,p50,p99,p999);
+        first=0; free(m.lat);
+    }
+    printf("total: %ld ops in %.2f s (%.1f ops/s)\n",total,el,el>0?total/el:0.0);
+    if(js){ fprintf(js,"},\"total_ops_per_sec\":%.2f}\n",el>0?total/el:0.0); fclose(js); printf("results: %s\n",cfg.out); }
+    return 0;
+}
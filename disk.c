@@ -1,10 +1,22 @@
 // disk.c — DSS disk node (UDP). Stores blocks in memory and serves reads.
 // Build: gcc -O2 -Wall -Wextra -pthread -o disk disk.c
-// Run:   ./disk <disk-name> <manager-ip> <manager-port> <my-mport> <my-cport>
-// thread: listen_m():m-port receives/prints manager-channel messages 
-//         listen_c(): c-port handles client data plane (WRITE and READ)
+// Run:   ./disk <disk-name> <manager-ip> <manager-port> <my-mport> <my-cport> [--store=mem|mmap:<path>] [--workers=N]
+//              [--capacity=<MB>] [--heartbeat=<ms>] [--metrics=<file> [--metrics-every=<sec>]]
+// thread: listen_m():m-port receives/prints manager-channel messages; "stats" (or "STATS")
+//                   from the manager's host is answered with per-op counters, latency
+//                   quantiles and store occupancy
+//         heartbeat(): every --heartbeat ms (default 1000, 0 = off) reports capacity, bytes
+//                      stored and recent I/O rate to the manager for its disk placement
+//         listen_c(): c-port handles client data plane (WRITE and READ), one per worker;
+//                     each worker owns a SO_REUSEPORT socket on the c-port pinned to a core;
+//                     a completed block is sealed with its CRC32C and verified on read,
+//                     a mismatch answers BP_E_CSUM so the client rebuilds it from parity
+//         metrics_dumper(): with --metrics=<file>, rewrites the same numbers in Prometheus
+//                     text format every --metrics-every s (default 10)
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -14,86 +26,716 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "proto.h"
 
 static void nobuf(void){ setvbuf(stdout,NULL,_IONBF,0); setvbuf(stderr,NULL,_IONBF,0); }
 
-static int sock_m=-1,sock_c=-1;
+static int sock_m=-1;
 static struct sockaddr_in mgr;
 static char dname_glob[64]={0};
 
+static double now_sec(void){ struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts); return ts.tv_sec+ts.tv_nsec/1e9; }
+
 static void peer_str(const struct sockaddr_in *sa, char *out, size_t outsz){
     char ip[INET_ADDRSTRLEN]="?"; inet_ntop(AF_INET,&sa->sin_addr,ip,sizeof(ip)); unsigned p=ntohs(sa->sin_port); snprintf(out,outsz,"%s:%u",ip,p);
 }
 
+// block store: entries live in fixed-size pages (never move once allocated),
+// found through an open-addressing index keyed by (dss,file,stripe,block).
+// freed slots go on a free list and are reused before new ones are carved.
+// block bytes come from power-of-two size classes (128 B .. 1 MiB, the configure-dss
+// su range) carved out of slabs, so a DSS's full blocks land exactly in its su class.
+// with --store=mmap:<path> the same classes are records appended to a mapped file instead
+// (see the mmap backend below), so blocks survive a disk restart.
+// the index is split into STORE_SHARDS shards picked by the top hash bits, each with its
+// own rwlock, so READs run in parallel with each other and with WRITEs to other shards.
+// block memory (slabs or mmap records) is shared and guarded by al.mu.
+// complete blocks are sealed with a CRC32C that READ verifies, and on the mem backend
+// identical ones share one buffer (see sealing and dedup below); STORE reports the ratio.
+#define PAGE_SHIFT 8
+#define PAGE_SLOTS (1u<<PAGE_SHIFT)
+#define IDX_EMPTY 0u
+#define IDX_TOMB  0xffffffffu
+#define STORE_SHARDS 64
+#define CLS_MIN_SHIFT 7
+#define CLS_COUNT 14
+#define BLOCK_MAX ((size_t)1<<(CLS_MIN_SHIFT+CLS_COUNT-1))
+#define SLAB_BYTES (256*1024)
+typedef struct { char dss[64]; char file[64]; long stripe; long block; } BlockKey;
+typedef struct Chunk Chunk;
+typedef struct { uint32_t lo, hi; } Range;
+typedef struct {
+    int used; int cls; uint32_t next_free; uint64_t h; BlockKey k; size_t len; unsigned char *data;
+    int sealed; uint32_t crc;            // sealed: every byte written, crc = CRC32C of data[0..len)
+    Chunk *ch;                           // shared buffer (mem backend, sealed) or NULL = private
+    Range *rng; uint32_t nr, rcap;       // unsealed: byte ranges written so far, sorted, disjoint
+} Block;
+typedef struct {
+    pthread_rwlock_t lk;
+    Block **pages; size_t npages;     // slot i -> pages[i>>PAGE_SHIFT][i&(PAGE_SLOTS-1)]
+    uint32_t nslots, free_head;       // free_head: slot+1 of first free slot, 0 = none
+    uint32_t *idx; size_t cap, count, tombs; // idx holds slot+1, IDX_EMPTY or IDX_TOMB
+    size_t resident;                  // bytes of live block data
+} Shard;
+static Shard shards[STORE_SHARDS];
+static struct {
+    pthread_mutex_t mu;
+    void *cls_free[CLS_COUNT]; size_t cls_inuse[CLS_COUNT];
+    void **slabs; size_t nslabs, slab_cap;
+    size_t slab_bytes;                // capacity carved from malloc (or the mapped file)
+    size_t inuse_bytes, limit;        // class bytes handed out; --capacity cap on them (0 = none)
+} al={ .mu=PTHREAD_MUTEX_INITIALIZER };
+static void store_init(void){ for(int i=0;i<STORE_SHARDS;i++) pthread_rwlock_init(&shards[i].lk,NULL); }
+static Shard* shard_of(uint64_t h){ return &shards[h>>58]; }
+
+// mmap backend: <path> = FileHdr, then records of RecHdr + cls_size(cls) data bytes appended
+// at tail. the file is mapped once over a large reserved range so block pointers never move;
+// a record is live once its header is stamped after the data copy, dead ones are reused per
+// class. on startup only the record headers are walked to rebuild the in-memory index.
+#define MAP_RESERVE ((size_t)64<<30)
+#define MAP_GROW ((size_t)64<<20)
+#define REC_MAGIC 0x4b4c4244u  // "DBLK"
+#define REC_LIVE 1u
+typedef struct { char magic[8]; uint64_t tail; uint64_t records; char pad[4072]; } FileHdr;
+typedef struct { uint32_t magic; uint16_t flags; uint16_t cls; uint64_t len; BlockKey k; uint32_t crc, sealed; char pad[24]; } RecHdr;
+_Static_assert(sizeof(FileHdr)==4096&&sizeof(RecHdr)%64==0,"on-disk layout");
+static size_t cls_size(int c){ return (size_t)1<<(CLS_MIN_SHIFT+c); }
+static struct { int on; int fd; unsigned char *base; size_t fsize; char path[256]; } mf;
+static FileHdr* mf_hdr(void){ return (FileHdr*)mf.base; }
+static RecHdr* rec_of(const unsigned char *data){ return (RecHdr*)(data-sizeof(RecHdr)); }
+static int mf_reserve(size_t end){
+    if(end<=mf.fsize) return 0;
+    size_t ns=(end+MAP_GROW-1)/MAP_GROW*MAP_GROW; if(ns>MAP_RESERVE) return -1;
+    if(ftruncate(mf.fd,(off_t)ns)<0) return -1;
+    mf.fsize=ns; return 0;
+}
+static unsigned char* rec_append(int c){
+    FileHdr *fh=mf_hdr(); size_t need=sizeof(RecHdr)+cls_size(c);
+    if(mf_reserve(fh->tail+need)<0) return NULL;
+    RecHdr *r=(RecHdr*)(mf.base+fh->tail); memset(r,0,sizeof(*r)); r->magic=REC_MAGIC; r->cls=(uint16_t)c;
+    fh->tail+=need; fh->records++; al.slab_bytes+=need;
+    return (unsigned char*)(r+1);
+}
+
+// su announced by the manager per DSS (DSS|dss=..|su=.. on the m-port); blocks larger are refused
+static struct { char dss[64]; size_t su; } *dss_su; static size_t ndss_su;
+static pthread_mutex_t dss_mu=PTHREAD_MUTEX_INITIALIZER;
+static void dss_note_su(const char *dss, size_t su){
+    pthread_mutex_lock(&dss_mu);
+    size_t i=0; while(i<ndss_su&&strcmp(dss_su[i].dss,dss)!=0) i++;
+    if(i==ndss_su){ void *p=realloc(dss_su,(ndss_su+1)*sizeof(*dss_su)); if(p){ dss_su=p; snprintf(dss_su[i].dss,sizeof(dss_su[i].dss),"%s",dss); ndss_su++; } }
+    if(i<ndss_su) dss_su[i].su=su;
+    pthread_mutex_unlock(&dss_mu);
+}
+static size_t dss_su_of(const char *dss){
+    size_t su=0; pthread_mutex_lock(&dss_mu);
+    for(size_t i=0;i<ndss_su;i++) if(strcmp(dss_su[i].dss,dss)==0){ su=dss_su[i].su; break; }
+    pthread_mutex_unlock(&dss_mu); return su;
+}
+
+static int size_class(size_t len){ int c=0; while(c<CLS_COUNT&&cls_size(c)<len) c++; return c<CLS_COUNT?c:-1; }
+static unsigned char* buf_alloc(int c){
+    unsigned char *p=NULL; pthread_mutex_lock(&al.mu);
+    if(al.limit&&al.inuse_bytes+cls_size(c)>al.limit) goto out; // full: the WRITE gets BP_E_FULL
+    if(mf.on&&!al.cls_free[c]){ if((p=rec_append(c))){ al.cls_inuse[c]++; al.inuse_bytes+=cls_size(c); } goto out; }
+    if(!al.cls_free[c]){
+        size_t bsz=cls_size(c), sb=bsz*4>SLAB_BYTES?bsz*4:SLAB_BYTES;
+        if(al.nslabs==al.slab_cap){ size_t nc=al.slab_cap?al.slab_cap*2:64; void **np=realloc(al.slabs,nc*sizeof(*np)); if(!np) goto out; al.slabs=np; al.slab_cap=nc; }
+        unsigned char *s=malloc(sb); if(!s) goto out;
+        al.slabs[al.nslabs++]=s; al.slab_bytes+=sb;
+        for(size_t off=0;off+bsz<=sb;off+=bsz){ *(void**)(s+off)=al.cls_free[c]; al.cls_free[c]=s+off; }
+    }
+    p=al.cls_free[c]; al.cls_free[c]=*(void**)p; al.cls_inuse[c]++; al.inuse_bytes+=cls_size(c);
+out:
+    pthread_mutex_unlock(&al.mu); return p;
+}
+static void buf_free(int c, void *p){
+    pthread_mutex_lock(&al.mu);
+    if(mf.on) rec_of(p)->flags=0;
+    *(void**)p=al.cls_free[c]; al.cls_free[c]=p; al.cls_inuse[c]--; al.inuse_bytes-=cls_size(c);
+    pthread_mutex_unlock(&al.mu);
+}
+// make a written block durable in the mapped file: key and length go in after the data
+static void rec_stamp(const Block *b){ if(!mf.on) return; RecHdr *r=rec_of(b->data); r->k=b->k; r->len=b->len; r->crc=b->crc; r->sealed=(uint32_t)b->sealed; r->flags=REC_LIVE; }
+
+// sealing and dedup: a block is sealed once every byte of it has been written (the written
+// byte ranges are merged, so resent or overlapping fragments count once, and a resend that
+// matches a sealed block's bytes leaves it sealed). sealing stores its CRC32C, which READ
+// checks on the block's first fragment, and on the mem backend looks the content up in a
+// table of shared buffers (chunks) keyed by CRC: an identical chunk gets one more reference
+// and the block's own buffer is freed. a WRITE that changes a sealed block first takes a
+// private copy (or the chunk itself when it is the last reference) and starts counting
+// again. the mmap backend keeps one record per key, so it seals without sharing.
+// lock order: shard -> cas.mu -> al.mu
+struct Chunk { uint32_t crc, refs; int cls; size_t len; unsigned char *data; Chunk *next; };
+static struct {
+    pthread_mutex_t mu;
+    Chunk **b; size_t nb, n;          // chained by crc
+    size_t saved;                     // bytes not stored thanks to sharing: sum of (refs-1)*len
+    _Atomic unsigned long long corrupt; // READs that found a block not matching its crc
+} cas={ .mu=PTHREAD_MUTEX_INITIALIZER };
+static Chunk** cas_slot(uint32_t crc){ return &cas.b[(crc*0x9e3779b1u)&(cas.nb-1)]; }
+static int cas_grow(void){
+    size_t nb=cas.nb?cas.nb*2:1024; Chunk **n=calloc(nb,sizeof(*n)); if(!n) return -1;
+    Chunk **old=cas.b; size_t onb=cas.nb; cas.b=n; cas.nb=nb;
+    for(size_t i=0;i<onb;i++) for(Chunk *c=old[i],*nx;c;c=nx){ nx=c->next; Chunk **sl=cas_slot(c->crc); c->next=*sl; *sl=c; }
+    free(old); return 0;
+}
+// 1 when this write completes the block
+static int block_fill(Block *b, size_t off, size_t n){
+    if(off==0&&n==b->len) return 1;
+    if(!n) return 0;
+    uint32_t lo=(uint32_t)off, hi=(uint32_t)(off+n), i=0, j;
+    while(i<b->nr&&b->rng[i].hi<lo) i++;
+    for(j=i;j<b->nr&&b->rng[j].lo<=hi;j++){ if(b->rng[j].lo<lo) lo=b->rng[j].lo; if(b->rng[j].hi>hi) hi=b->rng[j].hi; }
+    if(i==j){ // nothing to merge with: a new range at i
+        if(b->nr==b->rcap){ uint32_t nc=b->rcap?b->rcap*2:4; Range *nr=realloc(b->rng,nc*sizeof(*nr)); if(!nr) return 0; b->rng=nr; b->rcap=nc; }
+        memmove(b->rng+i+1,b->rng+i,(b->nr-i)*sizeof(Range)); b->nr++;
+    }else if(j>i+1){ memmove(b->rng+i+1,b->rng+j,(b->nr-j)*sizeof(Range)); b->nr-=j-i-1; }
+    b->rng[i].lo=lo; b->rng[i].hi=hi;
+    return b->nr==1&&b->rng[0].lo==0&&b->rng[0].hi>=b->len;
+}
+static void block_unfill(Block *b){ free(b->rng); b->rng=NULL; b->nr=b->rcap=0; }
+static void block_seal(Block *b){
+    b->crc=crc32c(0,b->data,b->len); b->sealed=1; block_unfill(b);
+    if(mf.on) return;
+    pthread_mutex_lock(&cas.mu);
+    Chunk *c=NULL;
+    if(cas.nb) for(c=*cas_slot(b->crc);c;c=c->next) if(c->crc==b->crc&&c->len==b->len&&!memcmp(c->data,b->data,b->len)) break;
+    if(c){
+        c->refs++; cas.saved+=b->len; pthread_mutex_unlock(&cas.mu);
+        buf_free(b->cls,b->data); b->data=c->data; b->cls=c->cls; b->ch=c; return;
+    }
+    if((cas.n+1>cas.nb&&cas_grow()<0)||!(c=malloc(sizeof(*c)))){ pthread_mutex_unlock(&cas.mu); return; } // stays private
+    c->crc=b->crc; c->refs=1; c->cls=b->cls; c->len=b->len; c->data=b->data;
+    Chunk **sl=cas_slot(c->crc); c->next=*sl; *sl=c; cas.n++; b->ch=c;
+    pthread_mutex_unlock(&cas.mu);
+}
+// give b a private buffer again before it is written (-1: no memory for the copy)
+static int block_unseal(Block *b){
+    if(b->ch){
+        pthread_mutex_lock(&cas.mu);
+        Chunk *c=b->ch;
+        if(c->refs>1){
+            unsigned char *nb=buf_alloc(c->cls); if(!nb){ pthread_mutex_unlock(&cas.mu); return -1; }
+            memcpy(nb,c->data,c->len); c->refs--; cas.saved-=c->len; b->data=nb;
+        }else{
+            Chunk **sl=cas_slot(c->crc); while(*sl!=c) sl=&(*sl)->next;
+            *sl=c->next; cas.n--; free(c);
+        }
+        pthread_mutex_unlock(&cas.mu);
+        b->ch=NULL;
+    }
+    b->sealed=0; b->nr=0; return 0;
+}
+
+static Block* slot_at(Shard *s, uint32_t i){ return &s->pages[i>>PAGE_SHIFT][i&(PAGE_SLOTS-1)]; }
+
+static uint64_t key_hash(const BlockKey *k){
+    uint64_t h=1469598103934665603ULL;
+    for(const char *p=k->dss;*p;++p){ h^=(unsigned char)*p; h*=1099511628211ULL; }
+    h^='|'; h*=1099511628211ULL;
+    for(const char *p=k->file;*p;++p){ h^=(unsigned char)*p; h*=1099511628211ULL; }
+    h^=(uint64_t)k->stripe*0x9e3779b97f4a7c15ULL; h=(h^(h>>29))*0xbf58476d1ce4e5b9ULL;
+    h^=(uint64_t)k->block*0x94d049bb133111ebULL; h^=h>>31;
+    return h;
+}
+static int key_eq(const BlockKey *a, const BlockKey *b){ return a->stripe==b->stripe&&a->block==b->block&&strcmp(a->dss,b->dss)==0&&strcmp(a->file,b->file)==0; }
+
+static int idx_rehash(Shard *s, size_t ncap){
+    uint32_t *n=calloc(ncap,sizeof(uint32_t)); if(!n) return -1;
+    for(size_t i=0;i<s->cap;i++){ uint32_t v=s->idx[i]; if(v==IDX_EMPTY||v==IDX_TOMB) continue;
+        size_t j=slot_at(s,v-1)->h&(ncap-1); while(n[j]!=IDX_EMPTY) j=(j+1)&(ncap-1); n[j]=v; }
+    free(s->idx); s->idx=n; s->cap=ncap; s->tombs=0; return 0;
+}
+static int idx_reserve(Shard *s){
+    if((s->count+s->tombs+1)*4<s->cap*3) return 0;
+    return idx_rehash(s,s->cap?(s->count*2>=s->cap?s->cap*2:s->cap):64);
+}
+// returns index position holding key, or -1; *ins gets the first reusable position on the probe path
+static long idx_find(Shard *s, const BlockKey *k, uint64_t h, long *ins){
+    if(ins) *ins=-1;
+    if(!s->cap) return -1;
+    for(size_t j=h&(s->cap-1);;j=(j+1)&(s->cap-1)){
+        uint32_t v=s->idx[j];
+        if(v==IDX_EMPTY){ if(ins&&*ins<0) *ins=(long)j; return -1; }
+        if(v==IDX_TOMB){ if(ins&&*ins<0) *ins=(long)j; continue; }
+        Block *b=slot_at(s,v-1); if(b->h==h&&key_eq(&b->k,k)) return (long)j;
+    }
+}
+static long slot_alloc(Shard *s){
+    if(s->free_head){ uint32_t i=s->free_head-1; s->free_head=slot_at(s,i)->next_free; return i; }
+    if(s->nslots==IDX_TOMB-1) return -1;
+    if((s->nslots>>PAGE_SHIFT)>=s->npages){
+        Block **np=realloc(s->pages,(s->npages+1)*sizeof(*np)); if(!np) return -1; s->pages=np;
+        if(!(s->pages[s->npages]=malloc(PAGE_SLOTS*sizeof(Block)))) return -1;
+        s->npages++;
+    }
+    return s->nslots++;
+}
+static Block* slot_insert(Shard *s, const BlockKey *k, uint64_t h, long ins){
+    long i=slot_alloc(s); if(i<0) return NULL;
+    Block *b=slot_at(s,(uint32_t)i); b->used=1; b->h=h; b->k=*k; b->len=0;
+    b->sealed=0; b->crc=0; b->ch=NULL; b->rng=NULL; b->nr=b->rcap=0;
+    if(s->idx[ins]==IDX_TOMB) s->tombs--;
+    s->idx[ins]=(uint32_t)i+1; s->count++;
+    return b;
+}
+
+// write n bytes at off into a block of total bytes (total 0 = off+n); a block whose
+// size changes moves to the matching class, a fresh buffer not fully covered is zeroed.
+// the write that completes a block seals it. -1: not a valid write (offset, length or size
+// past the block limit or the DSS's su), -2: no room (the --capacity limit, or memory)
+static int store_put(const BlockKey *k, size_t off, const unsigned char *data, size_t n, size_t total){
+    if(!total) total=off+n;
+    if(total>BLOCK_MAX||off+n>total) return -1;
+    size_t su=dss_su_of(k->dss); if(su&&total>su) return -1;
+    uint64_t h=key_hash(k); Shard *s=shard_of(h); int c=size_class(total), rc=-2;
+    unsigned char *old=NULL; int oldc=0;
+    pthread_rwlock_wrlock(&s->lk);
+    if(idx_reserve(s)<0) goto out;
+    long ins; long j=idx_find(s,k,h,&ins); Block *b;
+    if(j>=0){
+        b=slot_at(s,s->idx[j]-1);
+        if(b->sealed&&b->len==total&&!memcmp(b->data+off,data,n)){ rc=0; goto out; } // a resend: nothing changes
+        if(b->sealed&&block_unseal(b)<0) goto out;
+        if(b->len!=total) b->nr=0;
+        if(b->cls!=c){ unsigned char *nb=buf_alloc(c); if(!nb) goto out; old=b->data; oldc=b->cls; b->data=nb; b->cls=c; if(n<total) memset(nb,0,total); }
+        else if(total>b->len) memset(b->data+b->len,0,total-b->len);
+        s->resident-=b->len;
+    }else{
+        unsigned char *nb=buf_alloc(c); if(!nb) goto out;
+        if(!(b=slot_insert(s,k,h,ins))){ buf_free(c,nb); goto out; }
+        b->cls=c; b->data=nb;
+        if(n<total) memset(nb,0,total);
+    }
+    b->len=total; s->resident+=total; memcpy(b->data+off,data,n);
+    if(block_fill(b,off,n)) block_seal(b);
+    rec_stamp(b); rc=0;
+out:
+    pthread_rwlock_unlock(&s->lk);
+    if(old) buf_free(oldc,old);
+    return rc;
+}
+// a sealed block whose bytes no longer match its crc (checked on the fragment at off 0, so
+// once per block read rather than once per fragment)
+static int block_bad(const Block *b, size_t off){
+    if(off||!b->sealed||crc32c(0,b->data,b->len)==b->crc) return 0;
+    atomic_fetch_add_explicit(&cas.corrupt,1,memory_order_relaxed);
+    fprintf(stderr,"[disk %s] block %s/%s stripe %ld block %ld fails its checksum\n",dname_glob,b->k.dss,b->k.file,b->k.stripe,b->k.block);
+    return 1;
+}
+// copy up to *n bytes starting at off; *n gets the bytes copied, *total the block size.
+// -1: no such block, -2: corrupt
+static int store_get(const BlockKey *k, size_t off, unsigned char *out, size_t *n, size_t *total){
+    uint64_t h=key_hash(k); Shard *s=shard_of(h);
+    pthread_rwlock_rdlock(&s->lk);
+    long j=idx_find(s,k,h,NULL);
+    if(j<0){ pthread_rwlock_unlock(&s->lk); return -1; }
+    Block *b=slot_at(s,s->idx[j]-1);
+    if(out&&block_bad(b,off)){ pthread_rwlock_unlock(&s->lk); return -2; }
+    size_t L=off<b->len?b->len-off:0;
+    if(L>*n) L=*n;
+    if(out) memcpy(out,b->data+off,L);
+    *n=L; if(total) *total=b->len;
+    pthread_rwlock_unlock(&s->lk);
+    return 0;
+}
+// run fn on the live block bytes under the shard read lock, so the caller can hand them
+// straight to the kernel (sendmsg) without an intermediate copy. off is the reader's offset
+// (0 checks the crc); -1: no such block, -2: corrupt
+static int store_visit(const BlockKey *k, size_t off, int (*fn)(const unsigned char*,size_t,void*), void *ctx){
+    uint64_t h=key_hash(k); Shard *s=shard_of(h);
+    pthread_rwlock_rdlock(&s->lk);
+    long j=idx_find(s,k,h,NULL); int rc=-1;
+    if(j>=0){ Block *b=slot_at(s,s->idx[j]-1); rc=block_bad(b,off)?-2:fn(b->data,b->len,ctx); }
+    pthread_rwlock_unlock(&s->lk);
+    return rc;
+}
+static void store_clear(void){
+    for(int i=0;i<STORE_SHARDS;i++) pthread_rwlock_wrlock(&shards[i].lk);
+    pthread_mutex_lock(&al.mu);
+    pthread_mutex_lock(&cas.mu);
+    for(size_t i=0;i<cas.nb;i++) for(Chunk *c=cas.b[i],*nx;c;c=nx){ nx=c->next; free(c); }
+    free(cas.b); cas.b=NULL; cas.nb=cas.n=cas.saved=0;
+    pthread_mutex_unlock(&cas.mu);
+    for(int i=0;i<STORE_SHARDS;i++){
+        Shard *s=&shards[i];
+        for(uint32_t k=0;k<s->nslots;k++){ Block *b=slot_at(s,k); if(b->used) free(b->rng); }
+        for(size_t p=0;p<s->npages;p++) free(s->pages[p]);
+        free(s->pages); free(s->idx);
+        s->pages=NULL; s->npages=0; s->nslots=s->free_head=0; s->idx=NULL; s->cap=s->count=s->tombs=0; s->resident=0;
+    }
+    for(size_t i=0;i<al.nslabs;i++) free(al.slabs[i]);
+    free(al.slabs); al.slabs=NULL; al.nslabs=al.slab_cap=0; al.slab_bytes=0;
+    memset(al.cls_free,0,sizeof(al.cls_free)); memset(al.cls_inuse,0,sizeof(al.cls_inuse)); al.inuse_bytes=0;
+    if(mf.on){ mf_hdr()->tail=sizeof(FileHdr); mf_hdr()->records=0; mf.fsize=0; mf_reserve(sizeof(FileHdr)); }
+    pthread_mutex_unlock(&al.mu);
+    for(int i=STORE_SHARDS-1;i>=0;i--) pthread_rwlock_unlock(&shards[i].lk);
+}
+// insert an already-resident record (mmap warm start, single-threaded); a later record for the same key wins
+static int store_adopt(unsigned char *data){
+    RecHdr *r=rec_of(data); int c=r->cls;
+    uint64_t h=key_hash(&r->k); Shard *s=shard_of(h);
+    if(idx_reserve(s)<0) return -1;
+    long ins; long j=idx_find(s,&r->k,h,&ins); Block *b;
+    if(j>=0){ b=slot_at(s,s->idx[j]-1); s->resident-=b->len; buf_free(b->cls,b->data); }
+    else if(!(b=slot_insert(s,&r->k,h,ins))) return -1;
+    al.cls_inuse[c]++; al.inuse_bytes+=cls_size(c); b->cls=c; b->data=data; b->len=r->len; s->resident+=r->len;
+    b->sealed=r->sealed==1; b->crc=r->crc;
+    return 0;
+}
+static size_t store_count(void){ size_t n=0; for(int i=0;i<STORE_SHARDS;i++) n+=shards[i].count; return n; }
+static int store_open_mmap(const char *path){
+    snprintf(mf.path,sizeof(mf.path),"%s",path);
+    if((mf.fd=open(path,O_RDWR|O_CREAT,0644))<0){ perror(path); return -1; }
+    struct stat sb; if(fstat(mf.fd,&sb)<0){ perror("fstat"); return -1; }
+    mf.base=mmap(NULL,MAP_RESERVE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_NORESERVE,mf.fd,0);
+    if(mf.base==MAP_FAILED){ perror("mmap"); return -1; }
+    mf.on=1; mf.fsize=(size_t)sb.st_size;
+    FileHdr *fh=mf_hdr();
+    if(mf.fsize<sizeof(FileHdr)||memcmp(fh->magic,"DSSBLK01",8)!=0||fh->tail<sizeof(FileHdr)||fh->tail>mf.fsize){
+        if(mf.fsize>=sizeof(FileHdr)&&memcmp(fh->magic,"DSSBLK01",8)!=0){ fprintf(stderr,"%s: not a block store file\n",path); return -1; }
+        mf.fsize=0; if(mf_reserve(sizeof(FileHdr))<0){ perror("ftruncate"); return -1; }
+        memset(fh,0,sizeof(*fh)); memcpy(fh->magic,"DSSBLK01",8); fh->tail=sizeof(FileHdr);
+    }
+    double t0=now_sec(); size_t recs=0;
+    for(size_t off=sizeof(FileHdr);off<fh->tail;){
+        RecHdr *r=(RecHdr*)(mf.base+off);
+        if(r->magic!=REC_MAGIC||r->cls>=CLS_COUNT||off+sizeof(RecHdr)+cls_size(r->cls)>fh->tail){ fh->tail=off; break; } // torn tail
+        unsigned char *data=(unsigned char*)(r+1); size_t rsz=sizeof(RecHdr)+cls_size(r->cls);
+        al.slab_bytes+=rsz;
+        if(r->flags&REC_LIVE&&store_adopt(data)<0) return -1;
+        if(!(r->flags&REC_LIVE)){ *(void**)data=al.cls_free[r->cls]; al.cls_free[r->cls]=data; }
+        off+=rsz; recs++;
+    }
+    printf("[disk %s] mmap store %s: %zu blocks (%zu records) indexed in %.2f ms\n",dname_glob,path,store_count(),recs,(now_sec()-t0)*1e3);
+    return 0;
+}
+typedef struct { size_t blocks, resident, inuse, cap, index, chunks, saved; } StoreUse;
+static StoreUse store_use(void){
+    StoreUse u={0};
+    pthread_mutex_lock(&cas.mu); u.chunks=cas.n; u.saved=cas.saved; pthread_mutex_unlock(&cas.mu);
+    for(int i=0;i<STORE_SHARDS;i++){ Shard *s=&shards[i]; pthread_rwlock_rdlock(&s->lk); u.blocks+=s->count; u.resident+=s->resident; u.index+=s->cap*sizeof(uint32_t)+s->npages*PAGE_SLOTS*sizeof(Block); pthread_rwlock_unlock(&s->lk); }
+    pthread_mutex_lock(&al.mu); u.inuse=al.inuse_bytes; u.cap=al.slab_bytes; pthread_mutex_unlock(&al.mu);
+    return u;
+}
+static int store_usage(char *out, size_t outsz){
+    StoreUse u=store_use();
+    // dedup: resident bytes as written over what they take once shared chunks count once
+    return snprintf(out,outsz,"STORE|backend=%s|blocks=%zu|resident=%zu|allocated=%zu|capacity=%zu|index=%zu|chunks=%zu|dedup=%.2f|saved=%zu\n",
+        mf.on?"mmap":"mem",u.blocks,u.resident,u.inuse,u.cap,u.index,u.chunks,u.resident>u.saved?(double)u.resident/(double)(u.resident-u.saved):1.0,u.saved);
+}
+
+// ./disk --bench-store: puts/gets per second at 1k, 8k and 64k resident blocks, plus
+// gets/s with one reader thread per online core against the same shards
+typedef struct { const BlockKey *keys; size_t n, gets; unsigned seed; } BenchArg;
+static void* bench_reader(void *arg){
+    BenchArg *a=arg; unsigned char blk[512]; unsigned x=a->seed;
+    for(size_t i=0;i<a->gets;i++){ x=x*1103515245u+12345u; size_t L=sizeof(blk); store_get(&a->keys[x%a->n],0,blk,&L,NULL); }
+    return NULL;
+}
+static volatile uint32_t crc_sink; // keeps the checksum loops in bench_store live
+static int bench_store(void){
+    static const size_t sizes[]={1024,8192,65536};
+    unsigned char blk[512]; memset(blk,0xab,sizeof(blk));
+    int nthr=(int)sysconf(_SC_NPROCESSORS_ONLN); if(nthr<1) nthr=1;
+    char mtcol[32]; snprintf(mtcol,sizeof(mtcol),"get/s x%d thr",nthr);
+    printf("%-10s %14s %14s %14s %16s\n","resident","put/s","get/s","overwrite/s",mtcol);
+    for(size_t si=0;si<sizeof(sizes)/sizeof(sizes[0]);si++){
+        size_t n=sizes[si]; store_clear();
+        BlockKey *keys=malloc(n*sizeof(BlockKey)); if(!keys) return 1;
+        for(size_t i=0;i<n;i++){ memset(&keys[i],0,sizeof(BlockKey)); snprintf(keys[i].dss,64,"dss%zu",i%4); snprintf(keys[i].file,64,"file-%zu.bin",i/256); keys[i].stripe=(long)(i%256)/4; keys[i].block=(long)i%4; }
+        // every put carries distinct bytes, so none are deduplicated
+        double t0=now_sec(); for(size_t i=0;i<n;i++){ memcpy(blk,&i,sizeof(i)); store_put(&keys[i],0,blk,sizeof(blk),0); } double tp=now_sec()-t0;
+        size_t gets=n<1000000?1000000:n; unsigned x=12345; size_t hit=0;
+        t0=now_sec(); for(size_t i=0;i<gets;i++){ x=x*1103515245u+12345u; size_t L=sizeof(blk); if(store_get(&keys[x%n],0,blk,&L,NULL)==0) hit++; } double tg=now_sec()-t0;
+        t0=now_sec(); for(size_t i=0;i<n;i++){ size_t v=n+i; memcpy(blk,&v,sizeof(v)); store_put(&keys[(i*7919)%n],0,blk,sizeof(blk),0); } double to=now_sec()-t0;
+        pthread_t th[64]; BenchArg ba[64]; int nt=nthr>64?64:nthr;
+        t0=now_sec();
+        for(int t=0;t<nt;t++){ ba[t]=(BenchArg){keys,n,gets,(unsigned)t*7919u+1u}; pthread_create(&th[t],NULL,bench_reader,&ba[t]); }
+        for(int t=0;t<nt;t++) pthread_join(th[t],NULL);
+        double tm=now_sec()-t0;
+        char use[256]; store_usage(use,sizeof(use));
+        printf("%-10zu %14.0f %14.0f %14.0f %16.0f%s  %s",n,n/tp,gets/tg,n/to,gets*(double)nt/tm,hit==gets?"":"  (MISSES!)",use);
+        free(keys);
+    }
+    store_clear();
+    // block checksum (sealing, READ verification) over 64 KiB in cache
+    static unsigned char cb[65536]; for(size_t i=0;i<sizeof(cb);i++) cb[i]=(unsigned char)(i*131u);
+    size_t reps=20000; uint32_t acc=0; double t0=now_sec();
+    for(size_t i=0;i<reps;i++) acc^=crc32c_table(acc,cb,sizeof(cb));
+    double tt=now_sec()-t0; printf("crc32c: table %.2f GB/s",reps*sizeof(cb)/tt/1e9);
+#if defined(__x86_64__)
+    if(crc32c_hw()){ t0=now_sec(); for(size_t i=0;i<reps;i++) acc^=crc32c_sse42(acc,cb,sizeof(cb)); tt=now_sec()-t0; printf(", sse4.2 %.2f GB/s",reps*sizeof(cb)/tt/1e9); }
+#endif
+    printf(" (in use: %s)\n",crc32c_impl()); crc_sink=acc;
+    return 0;
+}
+
+// data-plane metrics (binary and text frames alike): service time from parse to reply, bytes
+// moved, non-OK answers; read_miss counts READs for blocks this disk doesn't have
+static Metric mx_write, mx_read; static _Atomic unsigned long long read_miss;
+static int stats_lines(char *out, size_t cap){
+    size_t o=0; char l[256]; unsigned long long n=atomic_load(&mx_read.n), miss=atomic_load(&read_miss);
+    mx_line(l,sizeof(l),&mx_write); o+=(size_t)snprintf(out+o,cap-o,"STAT|op=write|%s\n",l);
+    mx_line(l,sizeof(l),&mx_read); o+=(size_t)snprintf(out+o,cap-o,"STAT|op=read|%s|miss=%llu|miss_rate=%.4f|corrupt=%llu\n",l,miss,n?(double)miss/(double)n:0.0,atomic_load(&cas.corrupt));
+    if(o<cap) o+=(size_t)store_usage(out+o,cap-o);
+    if(o<cap) o+=(size_t)snprintf(out+o,cap-o,"SUCCESS\n");
+    return (int)(o<cap?o:cap-1);
+}
+
 void* listen_m(void *arg){
     (void)arg; char buf[4096]; struct sockaddr_in src; socklen_t slen=sizeof(src);
     for(;;){
         ssize_t n=recvfrom(sock_m,buf,sizeof(buf)-1,0,(struct sockaddr*)&src,&slen);
         if(n<=0) continue; buf[n]='\0';
         char peer[64]; peer_str(&src,peer,sizeof(peer));
+        // DSS| must come from the manager itself; STORE/STATS from the manager's host (tools run
+        // there; anywhere else, stdin "stats" and --metrics give the same numbers)
+        int mgr_host=src.sin_addr.s_addr==mgr.sin_addr.s_addr, from_mgr=mgr_host&&src.sin_port==mgr.sin_port;
+        if(from_mgr&&!strncmp(buf,"DSS|",4)){ char dss[64]=""; size_t su=0; if(sscanf(buf+4,"dss=%63[^|]|su=%zu",dss,&su)==2) dss_note_su(dss,su); }
+        if(!strncmp(buf,"STORE",5)){ if(mgr_host){ char line[256]; int m=store_usage(line,sizeof(line)); sendto(sock_m,line,m,0,(struct sockaddr*)&src,slen); } continue; }
+        if(!strncasecmp(buf,"STATS",5)){ if(mgr_host){ char out[1024]; int m=stats_lines(out,sizeof(out)); sendto(sock_m,out,(size_t)m,0,(struct sockaddr*)&src,slen); } continue; }
         printf("[disk %s] M %s | %s",dname_glob,peer,buf);
         if(buf[n-1]!='\n') printf("\n");
     }
     return NULL;
 }
 
-#define STORE_MAX 8192
-static struct { int used; char key[128]; size_t len; unsigned char data[4096]; } store[STORE_MAX];
+#define DGRAM_MAX 65507
+#define DATA_HDR_MAX 128
+
+// text protocol (binary frames are described in proto.h):
+// WRITE|dss=..|file=..|stripe=..|block=..|len=..[|off=..|total=..]\n<len bytes>
+// READ|dss=..|file=..|stripe=..|block=..[|off=..|len=..]\n  -> DATA|len=..[|off=..|total=..]\n<bytes>
+//   a missing block answers DATA|len=0, one that fails its seal checksum answers ERROR|csum
+// off/total let a block up to BLOCK_MAX travel as several datagram-sized fragments
+static long hdr_long(const char *hdr, const char *key, long defval){ const char *p=strstr(hdr,key); return p?atol(p+strlen(key)):defval; }
 
-static int store_put(const char *key, const unsigned char *data, size_t len){
-    for(int i=0;i<STORE_MAX;i++) if(store[i].used&&strcmp(store[i].key,key)==0){ store[i].len=len>sizeof(store[i].data)?sizeof(store[i].data):len; memcpy(store[i].data,data,store[i].len); return 0; }
-    for(int i=0;i<STORE_MAX;i++) if(!store[i].used){ store[i].used=1; snprintf(store[i].key,sizeof(store[i].key),"%s",key); store[i].len=len>sizeof(store[i].data)?sizeof(store[i].data):len; memcpy(store[i].data,data,store[i].len); return 0; }
-    return -1;
+#define WORKERS_MAX 64
+#define RECV_BATCH 16
+// each wakeup drains up to RECV_BATCH datagrams with one recvmmsg() and answers all READs
+// of that batch with one sendmmsg(); rx/tx hold one datagram-sized buffer per batch slot.
+// OK acks to BP_F_SACK writers from one peer are folded into that batch's first one
+typedef struct { int sock; int cpu; pthread_t th; unsigned char *rx, *tx; } Worker;
+
+// binary READ reply: header from the stack, payload straight from the store
+typedef struct { int sock; const struct sockaddr_in *dst; socklen_t dlen; BinHdr h; size_t off, want, sent; } BinRead;
+static _Atomic unsigned long long io_bytes; // data-plane payload bytes stored + served (heartbeat rate)
+static int bin_send_data(const unsigned char *data, size_t len, void *arg){
+    BinRead *r=arg; size_t L=r->off<len?len-r->off:0; if(L>r->want) L=r->want;
+    atomic_fetch_add_explicit(&io_bytes,L,memory_order_relaxed); r->sent=L;
+    BinHdr h=r->h; h.len=(uint32_t)L; h.total=(uint32_t)len;
+    if(h.flags&BP_F_CSUM) h.csum=crc32c(0,data+r->off,L);
+    bp_swap(&h);
+    struct iovec iov[2]={ {&h,sizeof(h)}, {(void*)(data+r->off),L} };
+    struct msghdr mh; memset(&mh,0,sizeof(mh)); mh.msg_name=(void*)r->dst; mh.msg_namelen=r->dlen; mh.msg_iov=iov; mh.msg_iovlen=2;
+    sendmsg(r->sock,&mh,0);
+    return 0;
 }
-static int store_get(const char *key, unsigned char *out, size_t *len){
-    for(int i=0;i<STORE_MAX;i++) if(store[i].used&&strcmp(store[i].key,key)==0){ size_t L=store[i].len; if(out&&len&&*len>=L){ memcpy(out,store[i].data,L); *len=L; return 0; } if(len) *len=L; return 0; }
-    return -1;
+
+// binary frame (see proto.h); READ is answered inline, WRITE/HELLO replies are built in frame
+static size_t handle_bin(int sock, const struct sockaddr_in *src, socklen_t slen, unsigned char *buf, size_t n, unsigned char *frame, unsigned char **out){
+    BinHdr h; if(n<sizeof(h)) return 0;
+    memcpy(&h,buf,sizeof(h)); bp_swap(&h);
+    BinHdr r; bp_init(&r,h.op==BP_READ?BP_DATA:h.op==BP_HELLO?BP_HELLO:BP_ACK);
+    r.seq=h.seq; r.flags=h.flags&(BP_F_CSUM|BP_F_SACK); r.stripe=h.stripe; r.block=h.block; r.off=h.off;
+    *out=frame;
+    if(h.op==BP_HELLO){ r.version=BP_VERSION; bp_swap(&r); memcpy(frame,&r,sizeof(r)); return sizeof(r); }
+    double t0=now_sec();
+    size_t names=(size_t)h.dss_len+h.file_len;
+    if(h.version<1||(h.op!=BP_WRITE&&h.op!=BP_READ)||!h.dss_len||!h.file_len||h.dss_len>63||h.file_len>63||sizeof(h)+names>n){ r.status=BP_E_BAD; goto reply; }
+    BlockKey k; memset(&k,0,sizeof(k));
+    memcpy(k.dss,buf+sizeof(h),h.dss_len); memcpy(k.file,buf+sizeof(h)+h.dss_len,h.file_len); k.stripe=(long)h.stripe; k.block=(long)h.block;
+    if(h.op==BP_READ){
+        BinRead rd={ sock,src,slen,r,h.off,h.len&&h.len<DGRAM_MAX-sizeof(h)?h.len:DGRAM_MAX-sizeof(h),0 };
+        int v=store_visit(&k,h.off,bin_send_data,&rd);
+        if(v==0){ mx_add(&mx_read,now_sec()-t0,rd.sent,0); return 0; }
+        if(v==-2){ r.status=BP_E_CSUM; goto reply; } // the client rebuilds it from parity
+        atomic_fetch_add_explicit(&read_miss,1,memory_order_relaxed);
+        r.status=BP_E_NOENT; goto reply;
+    }
+    const unsigned char *payload=buf+sizeof(h)+names;
+    if(h.len>n-sizeof(h)-names){ r.status=BP_E_BAD; goto reply; }
+    if((h.flags&BP_F_CSUM)&&crc32c(0,payload,h.len)!=h.csum){ r.status=BP_E_CSUM; goto reply; }
+    int pr=store_put(&k,h.off,payload,h.len,h.total);
+    r.status=pr==0?BP_OK:pr==-1?BP_E_BAD:BP_E_FULL;
+    if(r.status==BP_OK) atomic_fetch_add_explicit(&io_bytes,h.len,memory_order_relaxed);
+    r.len=h.len; r.total=h.total;
+reply:
+    if(h.op==BP_READ||h.op==BP_WRITE) mx_add(h.op==BP_READ?&mx_read:&mx_write,now_sec()-t0,h.op==BP_WRITE&&r.status==BP_OK?h.len:0,r.status!=BP_OK);
+    bp_swap(&r); memcpy(frame,&r,sizeof(r)); return sizeof(r);
+}
+
+// handle one c-port datagram in buf[0..n); returns the length of a reply built in frame
+// (reply starts at *out) or 0 when there is nothing to send back
+static size_t handle_c(int sock, const struct sockaddr_in *src, socklen_t slen, unsigned char *buf, size_t n, unsigned char *frame, unsigned char **out){
+    if(n&&buf[0]==BP_MAGIC) return handle_bin(sock,src,slen,buf,n,frame,out);
+    buf[n]='\0';
+    if(!strncmp((char*)buf,"FAIL|",5)){
+        // FAIL|id=<n>: wipe, then FAILED|id=<n>. a resent id is only acked again, so a late
+        // duplicate can't wipe blocks already rebuilt; fail_mu keeps an ack behind its wipe
+        static pthread_mutex_t fail_mu=PTHREAD_MUTEX_INITIALIZER; static unsigned long long last_fail;
+        const char *p=strstr((char*)buf,"id="); unsigned long long id=p?strtoull(p+3,NULL,10):0;
+        pthread_mutex_lock(&fail_mu);
+        if(!id||id!=last_fail){ store_clear(); last_fail=id; }
+        pthread_mutex_unlock(&fail_mu);
+        *out=frame; return (size_t)snprintf((char*)frame,DGRAM_MAX,"FAILED|id=%llu\n",id);
+    }
+    if(!strncmp((char*)buf,"WRITE|",6)){
+        double t0=now_sec(); int ok=0;
+        char dss[64]="",file[64]=""; long stripe=0,block=0,len=0;
+        char *hdr=(char*)buf+6; char *nl=strchr(hdr,'\n'); if(!nl) return 0;
+        *nl='\0';
+        sscanf(hdr,"dss=%63[^|]|file=%63[^|]|stripe=%ld|block=%ld|len=%ld",dss,file,&stripe,&block,&len);
+        long off=hdr_long(hdr,"|off=",0), total=hdr_long(hdr,"|total=",0);
+        unsigned char *payload=(unsigned char*)(nl+1);
+        if(len>0 && off>=0 && total>=0 && (size_t)len<=n-(size_t)(payload-buf)){ BlockKey k={0}; snprintf(k.dss,sizeof(k.dss),"%s",dss); snprintf(k.file,sizeof(k.file),"%s",file); k.stripe=stripe; k.block=block; if((ok=store_put(&k,(size_t)off,payload,(size_t)len,(size_t)total)==0)) atomic_fetch_add_explicit(&io_bytes,(unsigned long long)len,memory_order_relaxed); }
+        mx_add(&mx_write,now_sec()-t0,ok?(unsigned long long)len:0,!ok);
+        return 0;
+    }
+    if(!strncmp((char*)buf,"READ|",5)){
+        double t0=now_sec();
+        char dss[64]="",file[64]=""; long stripe=0,block=0; char *hdr=(char*)buf+5;
+        sscanf(hdr,"dss=%63[^|]|file=%63[^|]|stripe=%ld|block=%ld",dss,file,&stripe,&block);
+        long off=hdr_long(hdr,"|off=",0), want=hdr_long(hdr,"|len=",DGRAM_MAX-DATA_HDR_MAX);
+        if(off<0) off=0;
+        if(want<=0||want>DGRAM_MAX-DATA_HDR_MAX) want=DGRAM_MAX-DATA_HDR_MAX;
+        BlockKey k={0}; snprintf(k.dss,sizeof(k.dss),"%s",dss); snprintf(k.file,sizeof(k.file),"%s",file); k.stripe=stripe; k.block=block;
+        size_t L=(size_t)want,total=0;
+        int v=store_get(&k,(size_t)off,frame+DATA_HDR_MAX,&L,&total);
+        if(v==0){
+            char h[DATA_HDR_MAX]; int m=(off==0&&L==total)?snprintf(h,sizeof(h),"DATA|len=%zu\n",L):snprintf(h,sizeof(h),"DATA|len=%zu|off=%ld|total=%zu\n",L,off,total);
+            *out=frame+DATA_HDR_MAX-m; memcpy(*out,h,m); atomic_fetch_add_explicit(&io_bytes,L,memory_order_relaxed);
+            mx_add(&mx_read,now_sec()-t0,L,0); return m+L;
+        }
+        if(v==-1) atomic_fetch_add_explicit(&read_miss,1,memory_order_relaxed);
+        mx_add(&mx_read,now_sec()-t0,0,1);
+        *out=frame; return (size_t)snprintf((char*)frame,DGRAM_MAX,v==-2?"ERROR|csum\n":"DATA|len=0\n"); // a miss stays empty
+    }
+    return 0;
 }
-static void store_clear(void){ memset(store,0,sizeof(store)); }
 
 void* listen_c(void *arg){
-    (void)arg; unsigned char buf[8192]; struct sockaddr_in src; socklen_t slen=sizeof(src);
+    Worker *w=arg;
+    if(w->cpu>=0){ cpu_set_t cs; CPU_ZERO(&cs); CPU_SET(w->cpu,&cs); pthread_setaffinity_np(pthread_self(),sizeof(cs),&cs); }
+    struct mmsghdr rm[RECV_BATCH], sm[RECV_BATCH]; struct iovec riov[RECV_BATCH], siov[RECV_BATCH]; struct sockaddr_in src[RECV_BATCH];
+    for(int i=0;i<RECV_BATCH;i++){
+        riov[i].iov_base=w->rx+(size_t)i*(DGRAM_MAX+1); riov[i].iov_len=DGRAM_MAX;
+        memset(&rm[i],0,sizeof(rm[i])); rm[i].msg_hdr.msg_iov=&riov[i]; rm[i].msg_hdr.msg_iovlen=1;
+    }
     for(;;){
-        ssize_t n=recvfrom(sock_c,buf,sizeof(buf)-1,0,(struct sockaddr*)&src,&slen);
-        if(n<=0) continue; buf[n]='\0';
-        if(!strncmp((char*)buf,"FAIL|",5)){ store_clear(); continue; }
-        if(!strncmp((char*)buf,"WRITE|",6)){
-            char dss[64]="",file[64]=""; long stripe=0,block=0,len=0;
-            char *hdr=(char*)buf+6; char *nl=strchr(hdr,'\n'); if(!nl) continue; *nl='\0';
-            sscanf(hdr,"dss=%63[^|]|file=%63[^|]|stripe=%ld|block=%ld|len=%ld",dss,file,&stripe,&block,&len);
-            unsigned char *payload=(unsigned char*)(nl+1);
-            if(len>0 && (size_t)len<=sizeof(buf)-(payload-buf)){ char key[128]; snprintf(key,sizeof(key),"%s|%s|%ld|%ld",dss,file,stripe,block); store_put(key,payload,(size_t)len); }
-            continue;
-        }
-        if(!strncmp((char*)buf,"READ|",5)){
-            char dss[64]="",file[64]=""; long stripe=0,block=0; char *hdr=(char*)buf+5;
-            sscanf(hdr,"dss=%63[^|]|file=%63[^|]|stripe=%ld|block=%ld",dss,file,&stripe,&block);
-            char key[128]; snprintf(key,sizeof(key),"%s|%s|%ld|%ld",dss,file,stripe,block);
-            unsigned char out[4096]; size_t L=sizeof(out);
-            if(store_get(key,out,&L)==0){
-                unsigned char frame[4600]; int m=snprintf((char*)frame,sizeof(frame),"DATA|len=%zu\n",L);
-                memcpy(frame+m,out,L); sendto(sock_c,frame,m+L,0,(struct sockaddr*)&src,sizeof(src));
-            }else{
-                const char *e="DATA|len=0\n"; sendto(sock_c,e,strlen(e),0,(struct sockaddr*)&src,sizeof(src));
+        for(int i=0;i<RECV_BATCH;i++){ rm[i].msg_hdr.msg_name=&src[i]; rm[i].msg_hdr.msg_namelen=sizeof(src[i]); }
+        int got=recvmmsg(w->sock,rm,RECV_BATCH,MSG_WAITFORONE,NULL);
+        if(got<=0) continue;
+        int ns=0, sack[RECV_BATCH]; // sack[k]: reply k is an OK ack that later ones may be folded into
+        for(int i=0;i<got;i++){
+            unsigned char *out=NULL; size_t m=handle_c(w->sock,&src[i],rm[i].msg_hdr.msg_namelen,riov[i].iov_base,rm[i].msg_len,w->tx+(size_t)i*DGRAM_MAX,&out);
+            if(!m) continue;
+            BinHdr a; sack[ns]=0;
+            if(m==sizeof(a)&&out[0]==BP_MAGIC){
+                memcpy(&a,out,sizeof(a)); bp_swap(&a);
+                if(a.op==BP_ACK&&a.status==BP_OK&&(a.flags&BP_F_SACK)){
+                    int k=0; while(k<ns&&!(sack[k]&&sm[k].msg_hdr.msg_namelen==rm[i].msg_hdr.msg_namelen&&!memcmp(sm[k].msg_hdr.msg_name,&src[i],rm[i].msg_hdr.msg_namelen))) k++;
+                    if(k<ns&&bp_sack_add(siov[k].iov_base,&siov[k].iov_len,DGRAM_MAX,a.seq)) continue;
+                    sack[ns]=1;
+                }
             }
-            continue;
+            siov[ns].iov_base=out; siov[ns].iov_len=m;
+            memset(&sm[ns],0,sizeof(sm[ns])); sm[ns].msg_hdr.msg_name=&src[i]; sm[ns].msg_hdr.msg_namelen=rm[i].msg_hdr.msg_namelen;
+            sm[ns].msg_hdr.msg_iov=&siov[ns]; sm[ns].msg_hdr.msg_iovlen=1; ns++;
         }
+        for(int sent=0;sent<ns;){ int r=sendmmsg(w->sock,sm+sent,ns-sent,0); if(r<=0) break; sent+=r; }
+    }
+    return NULL;
+}
+
+// heartbeat name=<disk> cap=<bytes> used=<bytes> io_bps=<bytes/s> to the manager over the
+// m-port. cap is --capacity, else what the backend can hold (the mmap reservation, or RAM)
+static int hb_ms=1000; static size_t hb_cap;
+static void* heartbeat(void *arg){
+    (void)arg; unsigned long long last=atomic_load(&io_bytes); double t_last=now_sec();
+    for(;;){
+        usleep((useconds_t)hb_ms*1000);
+        unsigned long long b=atomic_load(&io_bytes); double t=now_sec();
+        pthread_mutex_lock(&al.mu); size_t used=al.inuse_bytes; pthread_mutex_unlock(&al.mu);
+        char line[256]; int n=snprintf(line,sizeof(line),"heartbeat name=%s cap=%zu used=%zu io_bps=%.0f\n",dname_glob,hb_cap,used,t>t_last?(double)(b-last)/(t-t_last):0.0);
+        sendto(sock_m,line,(size_t)n,0,(struct sockaddr*)&mgr,sizeof(mgr));
+        last=b; t_last=t;
     }
     return NULL;
 }
 
+static const char *metrics_path; static int metrics_every=10;
+static void metrics_emit(FILE *f){
+    char lb[128]; StoreUse u=store_use();
+    fprintf(f,"# HELP dss_disk_op_seconds Data-plane service time per WRITE/READ fragment.\n# TYPE dss_disk_op_seconds histogram\n");
+    snprintf(lb,sizeof(lb),"disk=\"%s\",op=\"write\"",dname_glob); mx_prom(f,"dss_disk_op_seconds",lb,&mx_write);
+    snprintf(lb,sizeof(lb),"disk=\"%s\",op=\"read\"",dname_glob); mx_prom(f,"dss_disk_op_seconds",lb,&mx_read);
+    fprintf(f,"# HELP dss_disk_op_bytes_total Payload bytes stored (write) or served (read).\n# TYPE dss_disk_op_bytes_total counter\n");
+    fprintf(f,"dss_disk_op_bytes_total{disk=\"%s\",op=\"write\"} %llu\ndss_disk_op_bytes_total{disk=\"%s\",op=\"read\"} %llu\n",dname_glob,atomic_load(&mx_write.bytes),dname_glob,atomic_load(&mx_read.bytes));
+    fprintf(f,"# HELP dss_disk_op_errors_total Fragments answered with an error status.\n# TYPE dss_disk_op_errors_total counter\n");
+    fprintf(f,"dss_disk_op_errors_total{disk=\"%s\",op=\"write\"} %llu\ndss_disk_op_errors_total{disk=\"%s\",op=\"read\"} %llu\n",dname_glob,atomic_load(&mx_write.err),dname_glob,atomic_load(&mx_read.err));
+    fprintf(f,"# HELP dss_disk_read_misses_total READs for blocks not stored here.\n# TYPE dss_disk_read_misses_total counter\ndss_disk_read_misses_total{disk=\"%s\"} %llu\n",dname_glob,atomic_load(&read_miss));
+    fprintf(f,"# HELP dss_disk_store_blocks Blocks stored.\n# TYPE dss_disk_store_blocks gauge\ndss_disk_store_blocks{disk=\"%s\"} %zu\n",dname_glob,u.blocks);
+    fprintf(f,"# HELP dss_disk_store_used_bytes Size-class bytes handed out to blocks.\n# TYPE dss_disk_store_used_bytes gauge\ndss_disk_store_used_bytes{disk=\"%s\"} %zu\n",dname_glob,u.inuse);
+    fprintf(f,"# HELP dss_disk_corrupt_reads_total READs that found a block failing its checksum.\n# TYPE dss_disk_corrupt_reads_total counter\ndss_disk_corrupt_reads_total{disk=\"%s\"} %llu\n",dname_glob,atomic_load(&cas.corrupt));
+    fprintf(f,"# HELP dss_disk_dedup_saved_bytes Block bytes not stored because identical blocks share a buffer.\n# TYPE dss_disk_dedup_saved_bytes gauge\ndss_disk_dedup_saved_bytes{disk=\"%s\"} %zu\n",dname_glob,u.saved);
+    fprintf(f,"# HELP dss_disk_dedup_ratio Resident block bytes over the bytes they occupy.\n# TYPE dss_disk_dedup_ratio gauge\ndss_disk_dedup_ratio{disk=\"%s\"} %.4f\n",dname_glob,u.resident>u.saved?(double)u.resident/(double)(u.resident-u.saved):1.0);
+    fprintf(f,"# HELP dss_disk_store_capacity_bytes Capacity reported to the manager.\n# TYPE dss_disk_store_capacity_bytes gauge\ndss_disk_store_capacity_bytes{disk=\"%s\"} %zu\n",dname_glob,hb_cap);
+}
+static void* metrics_dumper(void *arg){
+    (void)arg;
+    for(;;){ sleep((unsigned)metrics_every); if(mx_dump(metrics_path,metrics_emit)<0) fprintf(stderr,"[disk %s] metrics: can't write %s: %s\n",dname_glob,metrics_path,strerror(errno)); }
+    return NULL;
+}
+
 int main(int argc, char **argv){
-    nobuf();
-    if(argc!=6){ fprintf(stderr,"usage: disk <disk-name> <manager-ip> <manager-port> <my-mport> <my-cport>\n"); return 1; }
+    nobuf(); store_init();
+    if(argc==2&&strcmp(argv[1],"--bench-store")==0) return bench_store();
+    if(argc<6){ fprintf(stderr,"usage: disk <disk-name> <manager-ip> <manager-port> <my-mport> <my-cport> [--store=mem|mmap:<path>] [--workers=N] [--capacity=<MB>] [--heartbeat=<ms>] [--metrics=<file> [--metrics-every=<sec>]]\n"); return 1; }
     const char *dname=argv[1]; const char *mgr_ip=argv[2]; int mgr_port=atoi(argv[3]); int my_mport=atoi(argv[4]); int my_cport=atoi(argv[5]);
     strncpy(dname_glob,dname,sizeof(dname_glob)-1);
-    sock_m=socket(AF_INET,SOCK_DGRAM,0); sock_c=socket(AF_INET,SOCK_DGRAM,0); if(sock_m<0||sock_c<0){ perror("socket"); return 1; }
-    int yes=1; setsockopt(sock_m,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes)); setsockopt(sock_c,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
+    int ncpu=(int)sysconf(_SC_NPROCESSORS_ONLN); if(ncpu<1) ncpu=1;
+    int nworkers=ncpu>WORKERS_MAX?WORKERS_MAX:ncpu;
+    for(int i=6;i<argc;i++){
+        if(!strncmp(argv[i],"--workers=",10)){ nworkers=atoi(argv[i]+10); if(nworkers<1||nworkers>WORKERS_MAX){ fprintf(stderr,"--workers must be 1..%d\n",WORKERS_MAX); return 1; } continue; }
+        if(!strcmp(argv[i],"--store=mem")) continue;
+        if(!strncmp(argv[i],"--capacity=",11)&&atol(argv[i]+11)>0){ al.limit=(size_t)atol(argv[i]+11)<<20; continue; }
+        if(!strncmp(argv[i],"--heartbeat=",12)){ hb_ms=atoi(argv[i]+12); continue; }
+        if(!strncmp(argv[i],"--metrics=",10)&&argv[i][10]){ metrics_path=argv[i]+10; continue; }
+        if(!strncmp(argv[i],"--metrics-every=",16)&&atoi(argv[i]+16)>0){ metrics_every=atoi(argv[i]+16); continue; }
+        if(!strncmp(argv[i],"--store=mmap:",13)&&argv[i][13]){ if(store_open_mmap(argv[i]+13)<0) return 1; continue; }
+        fprintf(stderr,"unknown option: %s\n",argv[i]); return 1;
+    }
+    sock_m=socket(AF_INET,SOCK_DGRAM,0); if(sock_m<0){ perror("socket"); return 1; }
+    int yes=1; setsockopt(sock_m,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
     struct sockaddr_in me_m; memset(&me_m,0,sizeof(me_m)); me_m.sin_family=AF_INET; me_m.sin_port=htons(my_mport);
     struct sockaddr_in me_c; memset(&me_c,0,sizeof(me_c)); me_c.sin_family=AF_INET; me_c.sin_port=htons(my_cport);
     me_m.sin_addr.s_addr=htonl(INADDR_ANY); me_c.sin_addr.s_addr=htonl(INADDR_ANY);
     if(bind(sock_m,(struct sockaddr*)&me_m,sizeof(me_m))<0){ perror("bind m"); return 1; }
-    if(bind(sock_c,(struct sockaddr*)&me_c,sizeof(me_c))<0){ perror("bind c"); return 1; }
+    // SO_REUSEPORT would let a stale or second disk silently share the c-port, so check it is free first
+    int probe=socket(AF_INET,SOCK_DGRAM,0);
+    if(probe<0||bind(probe,(struct sockaddr*)&me_c,sizeof(me_c))<0){ perror("bind c"); return 1; }
+    close(probe);
+    static Worker workers[WORKERS_MAX];
+    for(int i=0;i<nworkers;i++){
+        Worker *w=&workers[i]; w->cpu=nworkers>1?i%ncpu:-1;
+        w->rx=malloc((size_t)RECV_BATCH*(DGRAM_MAX+1)); w->tx=malloc((size_t)RECV_BATCH*DGRAM_MAX);
+        if(!w->rx||!w->tx){ perror("malloc"); return 1; }
+        if((w->sock=socket(AF_INET,SOCK_DGRAM,0))<0){ perror("socket"); return 1; }
+        setsockopt(w->sock,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes)); setsockopt(w->sock,SOL_SOCKET,SO_REUSEPORT,&yes,sizeof(yes));
+        int rcvbuf=4<<20; setsockopt(w->sock,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+        if(bind(w->sock,(struct sockaddr*)&me_c,sizeof(me_c))<0){ perror("bind c"); return 1; }
+    }
     memset(&mgr,0,sizeof(mgr)); mgr.sin_family=AF_INET; mgr.sin_port=htons(mgr_port);
     if(inet_pton(AF_INET,mgr_ip,&mgr.sin_addr)!=1){ fprintf(stderr,"bad manager ip: %s\n",mgr_ip); return 1; }
     char my_ip[16]="127.0.0.1"; char reg[256];
@@ -102,13 +744,19 @@ int main(int argc, char **argv){
     sendto(sock_m,reg,n,0,(struct sockaddr*)&mgr,sizeof(mgr));
     // back ground threads: 
 		// tm: manager channel printer
-		// tc: cliente channel data plane
-    pthread_t tm,tc; 
-	if(pthread_create(&tm,NULL,listen_m,NULL)!=0){ perror("pthread_create"); return 1; } if(pthread_create(&tc,NULL,listen_c,NULL)!=0){ perror("pthread_create"); return 1; }
-    pthread_detach(tm); pthread_detach(tc);
+		// workers[]: cliente channel data plane
+    pthread_t tm; 
+	if(pthread_create(&tm,NULL,listen_m,NULL)!=0){ perror("pthread_create"); return 1; }
+    for(int i=0;i<nworkers;i++){ if(pthread_create(&workers[i].th,NULL,listen_c,&workers[i])!=0){ perror("pthread_create"); return 1; } pthread_detach(workers[i].th); }
+    pthread_detach(tm);
+    hb_cap=al.limit?al.limit:mf.on?MAP_RESERVE:(size_t)sysconf(_SC_PHYS_PAGES)*(size_t)sysconf(_SC_PAGESIZE);
+    if(metrics_path){ pthread_t mt; if(pthread_create(&mt,NULL,metrics_dumper,NULL)!=0){ perror("pthread_create"); return 1; } pthread_detach(mt); }
+    if(hb_ms>0){ pthread_t th; if(pthread_create(&th,NULL,heartbeat,NULL)!=0){ perror("pthread_create"); return 1; } pthread_detach(th); }
     char cmd[512];
     while(fgets(cmd,sizeof(cmd),stdin)){
         if(cmd[0]=='\n') continue;
+        if(!strcmp(cmd,"store\n")){ char line[256]; store_usage(line,sizeof(line)); fputs(line,stdout); continue; }
+        if(!strcmp(cmd,"stats\n")){ char out[1024]; stats_lines(out,sizeof(out)); fputs(out,stdout); continue; }
         if(cmd[strlen(cmd)-1]!='\n'){ size_t r=sizeof(cmd)-strlen(cmd)-1; strncat(cmd,"\n",r>0?r:0); }
         sendto(sock_m,cmd,strlen(cmd),0,(struct sockaddr*)&mgr,sizeof(mgr));
     }
@@ -1,11 +1,37 @@
 // manager.c — CSE434 DSS milestone manager (UDP)
 // Accepts both "REGISTER USER ..." and "register-user ..." styles.
 /// Build:   gcc -O2 -Wall -Wextra -o manager manager.c
-// Run:     ./manager <listen_port>
-// threads: none (sinlge-threaded on one UDP socket)
-// flags (safety): g_dss[].copy_in_progress, g_dss[].read_in_progress block 
-// decommission and fail when copy or read are active
+// Run:     ./manager <listen_port> [--workers=N] [--wal=<dir> [--fsync=batch|off|<ms>] [--snap-every=<records>]]
+//                    [--lease=<sec>] [--metrics=<file> [--metrics-every=<sec>]] [--quiet] [--log-level=error|info|trace]
+//          ./manager --bench-parse <trace>   (parser throughput over a command trace, e.g. a manager log)
+// dispatch: each request is tokenized in place in one pass, the command word goes through a
+//          perfect-hash table to its handler (cmds[]). "#<id> <command>" requests get every
+//          reply line tagged "#<id> " and a closing "#<id> DONE|lines=N"
+// threads: --workers=N receive threads (default 1), each on its own SO_REUSEPORT socket with
+//          recvmmsg/sendmmsg batches, + a log drain. registry under one rwlock, each DSS under
+//          its own mutex; ls copies one bounded page under them and replies after unlocking
+// metrics: every command verb has a request counter, a FAILURE counter and a latency histogram
+//          (lock wait + handler), updated lock-free; "stats" lists them as STAT| lines, and
+//          --metrics=<file> rewrites them in Prometheus text format every --metrics-every s (10)
+// logging: requests and replies are traced at level trace (the default) through an async ring;
+//          --quiet (= --log-level=info) keeps only state changes such as finished recoveries
+// state: users/disks/DSSes live in growable slot arrays with free lists; names resolve through
+//        hash indexes (one per namespace, plus one per DSS for its files); free disks sit in a
+//        linked pool; configure-dss places members by heartbeat (free space, load) across
+//        distinct host IPs and lists its choice as PLACE| lines
+// durability: with --wal=<dir>, state changes go to a group-committed write-ahead log plus
+//          periodic snapshots and are replayed on restart (leases, read/recovery flags are not kept)
+// leases: copy takes a write lease on one file (lease=<id>, --lease seconds, default 30), renewed
+//         with lease-renew and ended by copy-complete or copy-abort. uploads of different files
+//         into a DSS run side by side; a file under lease can't be read or copied again, and a
+//         file being read can't be copied over. leases not renewed in time are reclaimed
+//         whenever the DSS's leases are next looked at
+// flags (safety): live leases and g_dss[].read_in_progress block decommission and disk-failure
+// recovery: disk-failure names the failed disk and lists the files to rebuild; the user
+//           reports recovery-progress while rebuilding and recovery-complete at the end.
+//           copy and decommission are refused meanwhile, reads stay allowed (degraded)
 
+#define _GNU_SOURCE
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +40,15 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include "proto.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -22,10 +57,53 @@
 #define BUFSZ 4096
 #define NAME 64
 #define IPSTR 64
-#define MAX_USERS 64
-#define MAX_DISKS 64
-#define MAX_DSS 16
-#define MAX_FILES 512
+
+// name -> slot index: open addressing with linear probing over FNV-1a hashes. the table owns
+// copies of its keys; deleted entries leave tombstones that are dropped on the next rebuild
+typedef struct { char *key; uint32_t h; int val; } NameEnt;
+typedef struct { NameEnt *e; size_t cap, used, live; } NameIdx;
+#define NI_TOMB ((char*)1)
+
+static uint32_t name_hash(const char *s){ uint32_t h=2166136261u; while(*s){ h^=(unsigned char)*s++; h*=16777619u; } return h; }
+static double now_sec(void){ struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts); return ts.tv_sec+ts.tv_nsec/1e9; }
+static void* xrealloc(void *p, size_t sz){ void *q=realloc(p,sz); if(!q){ perror("realloc"); exit(1); } return q; }
+
+static NameEnt* ni_find(const NameIdx *ix, const char *key, uint32_t h){
+    if(!ix->cap) return NULL;
+    for(size_t i=h&(ix->cap-1);;i=(i+1)&(ix->cap-1)){
+        NameEnt *e=&ix->e[i];
+        if(!e->key) return NULL;
+        if(e->key!=NI_TOMB&&e->h==h&&strcmp(e->key,key)==0) return e;
+    }
+}
+static int ni_get(const NameIdx *ix, const char *key){ NameEnt *e=ni_find(ix,key,name_hash(key)); return e?e->val:-1; }
+static void ni_rehash(NameIdx *ix){
+    size_t cap=16; while(cap<ix->live*2+2) cap*=2;
+    NameEnt *ne=calloc(cap,sizeof(*ne)); if(!ne){ perror("calloc"); exit(1); }
+    for(size_t i=0;i<ix->cap;i++){
+        NameEnt *e=&ix->e[i]; if(!e->key||e->key==NI_TOMB) continue;
+        size_t j=e->h&(cap-1); while(ne[j].key) j=(j+1)&(cap-1);
+        ne[j]=*e;
+    }
+    free(ix->e); ix->e=ne; ix->cap=cap; ix->used=ix->live;
+}
+static void ni_put(NameIdx *ix, const char *key, int val){
+    uint32_t h=name_hash(key); NameEnt *e=ni_find(ix,key,h);
+    if(e){ e->val=val; return; }
+    if((ix->used+1)*4>ix->cap*3) ni_rehash(ix); // load (tombstones included) kept under 3/4
+    size_t i=h&(ix->cap-1); while(ix->e[i].key&&ix->e[i].key!=NI_TOMB) i=(i+1)&(ix->cap-1);
+    if(!ix->e[i].key) ix->used++;
+    ix->e[i].key=strdup(key); ix->e[i].h=h; ix->e[i].val=val; ix->live++;
+    if(!ix->e[i].key){ perror("strdup"); exit(1); }
+}
+static void ni_del(NameIdx *ix, const char *key){
+    NameEnt *e=ni_find(ix,key,name_hash(key)); if(!e) return;
+    free(e->key); e->key=NI_TOMB; ix->live--;
+}
+static void ni_free(NameIdx *ix){
+    for(size_t i=0;i<ix->cap;i++) if(ix->e[i].key&&ix->e[i].key!=NI_TOMB) free(ix->e[i].key);
+    free(ix->e); memset(ix,0,sizeof(*ix));
+}
 
 typedef struct {
     char name[NAME];
@@ -33,8 +111,7 @@ typedef struct {
     int mport;
     int cport;
     int used;
-    int assigned_n;
-    char assigned_disks[NAME*MAX_DISKS];
+    int next_free;
 } User;
 
 typedef enum { D_FREE = 0, D_IN_USE = 1 } DiskState;
@@ -46,29 +123,66 @@ typedef struct {
     DiskState state;
     char assigned_to[NAME];
     int used;
+    int next_free;
+    int pool_prev, pool_next; // links in the free-disk pool while state==D_FREE
+    long long cap, stored;    // from the last heartbeat (bytes); hb_at 0 = never heard
+    double io_bps, hb_at;
 } Disk;
 
 typedef struct {
     char fname[NAME];
     long long fsize;
     char owner[NAME];
+    int readers;               // reads between read and read-complete: a copy over the file waits for 0
 } FileMeta;
 
+// a write lease: one upload of fname in progress (id is handed to the client at copy time)
+typedef struct { char fname[NAME]; char owner[NAME]; unsigned long long id; double expires; } Lease;
+
+// immutable copy of a DSS's file table, shared by readers (ls, disk-failure) through a
+// reference count, so they walk it without the DSS mutex; rebuilt only when the table
+// changed since the last one (gen). the copy is cut into chunks of SNAP_CHUNK files, each
+// refcounted and stamped with the gen of its last change, so a rebuild shares every chunk
+// that didn't change and copies only the ones that did
+#define SNAP_CHUNK 256
+typedef struct { atomic_int refs; unsigned long gen; int n; FileMeta files[SNAP_CHUNK]; } SnapChunk;
+typedef struct { atomic_int refs; unsigned long gen; int nfiles, nchunks; SnapChunk **chunks; } FileSnap;
+static const FileMeta* snap_file(const FileSnap *s, int f){ return &s->chunks[f/SNAP_CHUNK]->files[f%SNAP_CHUNK]; }
+
 typedef struct {
     int used;
+    int next_free;
+    unsigned long inc;         // incarnation: tells a reused slot from the DSS it held before
     char name[NAME];
     int n;
     int striping_unit;
-    char disk_name[MAX_DISKS][NAME];
-    FileMeta files[MAX_FILES];
-    int files_used;
-    int copy_in_progress;
+    int *disk;                 // member disks by stripe position (g_disks slots)
+    FileMeta *files;
+    int files_used, files_cap;
+    NameIdx file_idx;
+    Lease *leases;             // uploads in progress, unordered
+    int nleases, leases_cap;
     int read_in_progress;
+    int recovering;            // disk position being rebuilt, -1 when healthy
+    long long rec_done, rec_total;
+    double rec_mbps;
+    pthread_mutex_t *mu;       // guards everything below the registry fields (files, flags, recovery)
+    unsigned long gen;         // bumped on every file table change
+    unsigned long *cgen;       // per SNAP_CHUNK of files: the gen that last changed it
+    int cgen_cap;
+    FileSnap *snap;
 } DSS;
 
-static User g_users[MAX_USERS];
-static Disk g_disks[MAX_DISKS];
-static DSS g_dss[MAX_DSS];
+// slot arrays grow by doubling and chain freed slots through next_free for reuse, so slot
+// numbers stay stable; the name indexes map names to slots
+static User *g_users; static int g_users_n, g_users_cap, g_users_free=-1; static NameIdx g_user_idx;
+static Disk *g_disks; static int g_disks_n, g_disks_cap, g_disks_free=-1; static NameIdx g_disk_idx;
+static DSS *g_dss; static int g_dss_n, g_dss_cap, g_dss_free=-1; static NameIdx g_dss_idx; static unsigned long g_dss_inc;
+static int g_pool_head=-1, g_pool_tail=-1, g_pool_n; // free disks, in registration order
+// the registry (all of the above plus slot reuse) is guarded by g_reg: readers resolve names and
+// reach a DSS under the read lock, then take that DSS's own mutex, so commands on different
+// DSSes run in parallel; register/deregister/configure/decommission take it for writing
+static pthread_rwlock_t g_reg=PTHREAD_RWLOCK_INITIALIZER;
 
 static void nobuf(void){ setvbuf(stdout,NULL,_IONBF,0); setvbuf(stderr,NULL,_IONBF,0); }
 
@@ -89,318 +203,1038 @@ static const char* kvget(const char *line, const char *key, char *out, size_t ou
     return NULL;
 }
 
-static void send_line(int sock, const struct sockaddr *dst, socklen_t dlen, const char *fmt, ...){
-    char line[BUFSZ]; va_list ap; va_start(ap,fmt); vsnprintf(line,sizeof(line),fmt,ap); va_end(ap);
-    size_t len=strlen(line); int add_nl=(len==0||line[len-1]!='\n');
-    char out[BUFSZ];
-    if(add_nl) snprintf(out,sizeof(out),"%s\n",line); else { strncpy(out,line,sizeof(out)-1); out[sizeof(out)-1]='\0'; }
-    sendto(sock,out,strlen(out),0,dst,dlen);
-    printf("%s",out);
+// logging never blocks a request: lines are formatted straight into a slot of a lock-free
+// ring (bounded MPMC queue, per-slot sequence numbers) and a drain thread batches them out
+// with write(). when the ring is full the line is dropped and counted instead of waiting.
+// levels: error < info (state changes) < trace (every request and reply line)
+enum { LOG_ERR=0, LOG_INFO=1, LOG_TRACE=2 };
+#define LOG_SLOTS 4096
+#define LOG_LINE 496
+typedef struct { atomic_size_t seq; unsigned len; char text[LOG_LINE]; } LogSlot;
+static LogSlot log_ring[LOG_SLOTS];
+static atomic_size_t log_head; static size_t log_tail; static atomic_ulong log_dropped;
+static int log_level=LOG_TRACE;
+#define LOGF(lvl,...) do{ if((lvl)<=log_level) log_printf(__VA_ARGS__); }while(0)
+
+static LogSlot* log_claim(size_t *pos_out){
+    size_t pos=atomic_load_explicit(&log_head,memory_order_relaxed);
+    for(;;){
+        LogSlot *s=&log_ring[pos&(LOG_SLOTS-1)];
+        size_t seq=atomic_load_explicit(&s->seq,memory_order_acquire);
+        if(seq==pos){ if(atomic_compare_exchange_weak_explicit(&log_head,&pos,pos+1,memory_order_relaxed,memory_order_relaxed)){ *pos_out=pos; return s; } }
+        else if(seq<pos){ atomic_fetch_add_explicit(&log_dropped,1,memory_order_relaxed); return NULL; } // full
+        else pos=atomic_load_explicit(&log_head,memory_order_relaxed);
+    }
+}
+static void log_publish(LogSlot *s, size_t pos, size_t len){
+    if(len>=LOG_LINE) len=LOG_LINE-1;
+    if(!len||s->text[len-1]!='\n') s->text[len++]='\n';
+    s->len=(unsigned)len; atomic_store_explicit(&s->seq,pos+1,memory_order_release);
+}
+static void __attribute__((format(printf,1,2))) log_printf(const char *fmt, ...){
+    size_t pos; LogSlot *s=log_claim(&pos); if(!s) return;
+    va_list ap; va_start(ap,fmt); int m=vsnprintf(s->text,LOG_LINE-1,fmt,ap); va_end(ap);
+    log_publish(s,pos,m<0?0:(size_t)m);
+}
+static void log_raw(const char *p, size_t len){
+    size_t pos; LogSlot *s=log_claim(&pos); if(!s) return;
+    if(len>LOG_LINE-1) len=LOG_LINE-1;
+    memcpy(s->text,p,len); log_publish(s,pos,len);
+}
+static void* log_drain(void *arg){
+    (void)arg; static char out[1<<16]; unsigned long reported=0;
+    for(;;){
+        size_t used=0;
+        for(;;){
+            LogSlot *s=&log_ring[log_tail&(LOG_SLOTS-1)];
+            if(atomic_load_explicit(&s->seq,memory_order_acquire)!=log_tail+1) break;
+            if(used+s->len>sizeof(out)) break;
+            memcpy(out+used,s->text,s->len); used+=s->len;
+            atomic_store_explicit(&s->seq,log_tail+LOG_SLOTS,memory_order_release); log_tail++;
+        }
+        unsigned long dropped=atomic_load_explicit(&log_dropped,memory_order_relaxed);
+        if(dropped!=reported&&used+64<sizeof(out)){ used+=(size_t)snprintf(out+used,64,"log: %lu lines dropped\n",dropped-reported); reported=dropped; }
+        for(size_t w=0;w<used;){ ssize_t k=write(STDOUT_FILENO,out+w,used-w); if(k<=0) break; w+=(size_t)k; }
+        if(!used){ struct timespec ts={0,2000000}; nanosleep(&ts,NULL); }
+    }
+    return NULL;
+}
+static void log_start(void){
+    for(size_t i=0;i<LOG_SLOTS;i++) atomic_init(&log_ring[i].seq,i);
+    pthread_t th; if(pthread_create(&th,NULL,log_drain,NULL)!=0){ perror("pthread_create"); exit(1); }
+    pthread_detach(th);
+}
+
+// replies are queued per worker thread, not sent: consecutive lines to the same peer are packed into one
+// datagram up to REPLY_MTU bytes, and the whole queue goes out with one sendmmsg() when the
+// receive batch is done (or the queue fills)
+#define REPLY_MTU 1472
+#define OUTQ_MAX 64
+#define RECV_BATCH 32
+static __thread struct { char buf[OUTQ_MAX][BUFSZ]; size_t len[OUTQ_MAX]; struct sockaddr_storage dst[OUTQ_MAX]; socklen_t dlen[OUTQ_MAX]; int n; } outq;
+
+static void wal_commit(void);
+// every way out for replies goes through here, so a batch's WAL records are committed first
+static void reply_flush(int sock){
+    if(!outq.n) return;
+    wal_commit();
+    struct mmsghdr mm[OUTQ_MAX]; struct iovec iov[OUTQ_MAX];
+    for(int i=0;i<outq.n;i++){
+        iov[i].iov_base=outq.buf[i]; iov[i].iov_len=outq.len[i];
+        memset(&mm[i],0,sizeof(mm[i])); mm[i].msg_hdr.msg_name=&outq.dst[i]; mm[i].msg_hdr.msg_namelen=outq.dlen[i];
+        mm[i].msg_hdr.msg_iov=&iov[i]; mm[i].msg_hdr.msg_iovlen=1;
+    }
+    for(int sent=0;sent<outq.n;){ int r=sendmmsg(sock,mm+sent,outq.n-sent,0); if(r<=0){ perror("sendmmsg"); break; } sent+=r; }
+    outq.n=0;
+}
+
+// the line is formatted once, straight into its datagram: appended to the last queued one
+// when that goes to the same peer and has room, else into a fresh queue entry. a tag (the
+// request's id) goes in front as "#<tag> "
+static void __attribute__((format(printf,5,6))) send_line(int sock, const struct sockaddr *dst, socklen_t dlen, const char *tag, const char *fmt, ...){
+    int last=outq.n-1; va_list ap;
+    if(last>=0&&outq.dlen[last]==dlen&&memcmp(&outq.dst[last],dst,dlen)==0&&outq.len[last]+1<REPLY_MTU){
+        char *p=outq.buf[last]+outq.len[last]; size_t room=REPLY_MTU-outq.len[last];
+        int t=tag?snprintf(p,room,"#%s ",tag):0, m=(int)room;
+        if((size_t)t<room){ va_start(ap,fmt); m=vsnprintf(p+t,room-(size_t)t,fmt,ap); va_end(ap); }
+        size_t len=m<0?0:(size_t)(t+m), nl=!len||p[len-1]!='\n';
+        if(len+nl<room){
+            if(nl) p[len++]='\n';
+            outq.len[last]+=len;
+            if(log_level>=LOG_TRACE) log_raw(p,len);
+            return;
+        }
+    }
+    if(outq.n==OUTQ_MAX) reply_flush(sock);
+    int i=outq.n++; char *p=outq.buf[i];
+    int t=tag?snprintf(p,BUFSZ-1,"#%s ",tag):0;
+    va_start(ap,fmt); int m=vsnprintf(p+t,BUFSZ-1-(size_t)t,fmt,ap); va_end(ap);
+    size_t len=m<0?(size_t)t:((size_t)(t+m)<BUFSZ-1?(size_t)(t+m):BUFSZ-2);
+    if(!len||p[len-1]!='\n') p[len++]='\n';
+    outq.len[i]=len; memcpy(&outq.dst[i],dst,dlen); outq.dlen[i]=dlen;
+    if(log_level>=LOG_TRACE) log_raw(p,len);
 }
 
-static int user_index(const char *name){ for(int i=0;i<MAX_USERS;i++) if(g_users[i].used&&strcmp(g_users[i].name,name)==0) return i; return -1; }
-static int disk_index(const char *name){ for(int i=0;i<MAX_DISKS;i++) if(g_disks[i].used&&strcmp(g_disks[i].name,name)==0) return i; return -1; }
+// one-way notice to a disk's m-port (disks print it and act on the ones they know)
+static void notify_disk(int sock, const Disk *d, const char *fmt, ...){
+    char line[BUFSZ]; va_list ap; va_start(ap,fmt); int m=vsnprintf(line,sizeof(line),fmt,ap); va_end(ap);
+    if(m<0||m>=(int)sizeof(line)) return;
+    struct sockaddr_in dst; memset(&dst,0,sizeof(dst)); dst.sin_family=AF_INET; dst.sin_port=htons((uint16_t)d->mport);
+    if(inet_pton(AF_INET,d->ip,&dst.sin_addr)!=1) return;
+    sendto(sock,line,(size_t)m,0,(struct sockaddr*)&dst,sizeof(dst));
+}
+
+// take a slot from the free list, else append one (doubling the array)
+static int slot_new(void **arr, size_t sz, int *n, int *cap, int *free_head, size_t next_off){
+    if(*free_head>=0){ int i=*free_head; *free_head=*(int*)((char*)*arr+(size_t)i*sz+next_off); memset((char*)*arr+(size_t)i*sz,0,sz); return i; }
+    if(*n==*cap){ *cap=*cap?*cap*2:16; *arr=xrealloc(*arr,(size_t)*cap*sz); }
+    memset((char*)*arr+(size_t)*n*sz,0,sz);
+    return (*n)++;
+}
+static void slot_release(void *arr, size_t sz, int i, int *free_head, size_t next_off){
+    memset((char*)arr+(size_t)i*sz,0,sz); *(int*)((char*)arr+(size_t)i*sz+next_off)=*free_head; *free_head=i;
+}
+
+// free-disk pool: doubly linked through the disk slots so taking out the disks placement
+// picks and returning or deregistering any one disk are all O(1) per disk
+static void pool_push(int i){
+    g_disks[i].pool_prev=g_pool_tail; g_disks[i].pool_next=-1;
+    if(g_pool_tail>=0) g_disks[g_pool_tail].pool_next=i; else g_pool_head=i;
+    g_pool_tail=i; g_pool_n++;
+}
+static void pool_unlink(int i){
+    Disk *d=&g_disks[i];
+    if(d->pool_prev>=0) g_disks[d->pool_prev].pool_next=d->pool_next; else g_pool_head=d->pool_next;
+    if(d->pool_next>=0) g_disks[d->pool_next].pool_prev=d->pool_prev; else g_pool_tail=d->pool_prev;
+    g_pool_n--;
+}
+static void disk_release(int i){ g_disks[i].state=D_FREE; g_disks[i].assigned_to[0]='\0'; pool_push(i); }
+
+static int user_index(const char *name){ return ni_get(&g_user_idx,name); }
+static int disk_index(const char *name){ return ni_get(&g_disk_idx,name); }
 static int add_user(const char *name, const char *ip, int mport, int cport){
     if(user_index(name)>=0) return -2;
-    for(int i=0;i<MAX_USERS;i++) if(!g_users[i].used){
-        g_users[i].used=1;
-        snprintf(g_users[i].name,NAME,"%s",name);
-        snprintf(g_users[i].ip,IPSTR,"%s",ip);
-        g_users[i].mport=mport; g_users[i].cport=cport;
-        g_users[i].assigned_n=0; g_users[i].assigned_disks[0]='\0';
-        return 0;
-    }
-    return -1;
+    int i=slot_new((void**)&g_users,sizeof(User),&g_users_n,&g_users_cap,&g_users_free,offsetof(User,next_free));
+    g_users[i].used=1;
+    snprintf(g_users[i].name,NAME,"%s",name);
+    snprintf(g_users[i].ip,IPSTR,"%s",ip);
+    g_users[i].mport=mport; g_users[i].cport=cport;
+    ni_put(&g_user_idx,g_users[i].name,i);
+    return 0;
 }
 static int add_disk(const char *name, const char *ip, int mport, int cport){
     if(disk_index(name)>=0) return -2;
-    for(int i=0;i<MAX_DISKS;i++) if(!g_disks[i].used){
-        g_disks[i].used=1;
-        snprintf(g_disks[i].name,NAME,"%s",name);
-        snprintf(g_disks[i].ip,IPSTR,"%s",ip);
-        g_disks[i].mport=mport; g_disks[i].cport=cport;
-        g_disks[i].state=D_FREE; g_disks[i].assigned_to[0]='\0';
-        return 0;
-    }
-    return -1;
+    int i=slot_new((void**)&g_disks,sizeof(Disk),&g_disks_n,&g_disks_cap,&g_disks_free,offsetof(Disk,next_free));
+    g_disks[i].used=1;
+    snprintf(g_disks[i].name,NAME,"%s",name);
+    snprintf(g_disks[i].ip,IPSTR,"%s",ip);
+    g_disks[i].mport=mport; g_disks[i].cport=cport;
+    ni_put(&g_disk_idx,g_disks[i].name,i);
+    disk_release(i);
+    return 0;
 }
 static void free_user(const char *name){
     int ui=user_index(name); if(ui<0) return;
-    for(int i=0;i<MAX_DISKS;i++) if(g_disks[i].used&&g_disks[i].state==D_IN_USE&&strcmp(g_disks[i].assigned_to,name)==0){ g_disks[i].state=D_FREE; g_disks[i].assigned_to[0]='\0'; }
-    memset(&g_users[ui],0,sizeof(User));
+    ni_del(&g_user_idx,name);
+    slot_release(g_users,sizeof(User),ui,&g_users_free,offsetof(User,next_free));
 }
 static void free_disk(const char *name){
     int di=disk_index(name); if(di<0) return;
-    g_disks[di].state=D_FREE; g_disks[di].assigned_to[0]='\0';
-    memset(&g_disks[di],0,sizeof(Disk));
-}
-static int allocate_disks(const char *user, int n, char *out_csv, size_t out_sz){
-    int free_count=0; for(int i=0;i<MAX_DISKS;i++) if(g_disks[i].used&&g_disks[i].state==D_FREE) free_count++;
-    if(free_count<n) return -free_count;
-    out_csv[0]='\0'; int taken=0;
-    for(int i=0;i<MAX_DISKS&&taken<n;i++) if(g_disks[i].used&&g_disks[i].state==D_FREE){
-        g_disks[i].state=D_IN_USE; snprintf(g_disks[i].assigned_to,NAME,"%s",user);
-        if(taken) strncat(out_csv,",",out_sz-strlen(out_csv)-1);
-        strncat(out_csv,g_disks[i].name,out_sz-strlen(out_csv)-1);
-        taken++;
-    }
-    return taken;
-}
-static int parse_int_token_or_kv(char **tokens, int ntok, const char *kvkey, int defval){
-    for(int i=0;i<ntok;i++){
-        if(strchr(tokens[i],'=')){ char k[32],v[32]; if(sscanf(tokens[i],"%31[^=]=%31s",k,v)==2){ if(strcasecmp(k,kvkey)==0) return atoi(v); } }
-        else if(isdigit((unsigned char)tokens[i][0])) return atoi(tokens[i]);
-    }
-    return defval;
-}
-static int dss_index(const char *name){ for(int i=0;i<MAX_DSS;i++) if(g_dss[i].used&&strcmp(g_dss[i].name,name)==0) return i; return -1; }
-static int dss_new_slot(void){ for(int i=0;i<MAX_DSS;i++) if(!g_dss[i].used) return i; return -1; }
-static int dss_file_index(DSS *d, const char *fname){ for(int i=0;i<d->files_used;i++) if(strcmp(d->files[i].fname,fname)==0) return i; return -1; }
-static int is_power_of_two(int x){ return x>0 && (x&(x-1))==0; }
-
-// single threaded mgr: one recvfrom() loop
-// no mutex needed
+    if(g_disks[di].state==D_FREE) pool_unlink(di);
+    ni_del(&g_disk_idx,name);
+    slot_release(g_disks,sizeof(Disk),di,&g_disks_free,offsetof(Disk,next_free));
+}
+static int dss_index(const char *name){ return ni_get(&g_dss_idx,name); }
+static int dss_new_slot(void){ return slot_new((void**)&g_dss,sizeof(DSS),&g_dss_n,&g_dss_cap,&g_dss_free,offsetof(DSS,next_free)); }
+static int dss_file_index(DSS *d, const char *fname){ return ni_get(&d->file_idx,fname); }
+// record a file (a second copy under the same name replaces the first)
+static int dss_file_put(DSS *d, const char *fname){
+    int fi=dss_file_index(d,fname); if(fi>=0) return fi;
+    if(d->files_used==d->files_cap){ d->files_cap=d->files_cap?d->files_cap*2:16; d->files=xrealloc(d->files,(size_t)d->files_cap*sizeof(FileMeta)); }
+    fi=d->files_used++; memset(&d->files[fi],0,sizeof(FileMeta)); snprintf(d->files[fi].fname,NAME,"%s",fname);
+    ni_put(&d->file_idx,d->files[fi].fname,fi);
+    return fi;
+}
+static void chunk_unref(SnapChunk *c){ if(atomic_fetch_sub(&c->refs,1)==1) free(c); }
+static void snap_unref(FileSnap *s){
+    if(!s||atomic_fetch_sub(&s->refs,1)!=1) return;
+    for(int c=0;c<s->nchunks;c++) chunk_unref(s->chunks[c]);
+    free(s->chunks); free(s);
+}
+// a reference to the current file snapshot, rebuilt first if stale (d->mu held)
+static FileSnap* dss_snapshot(DSS *d){
+    if(!d->snap||d->snap->gen!=d->gen){
+        FileSnap *o=d->snap, *s=xrealloc(NULL,sizeof(FileSnap)); int nch=(d->files_used+SNAP_CHUNK-1)/SNAP_CHUNK;
+        atomic_init(&s->refs,1); s->gen=d->gen; s->nfiles=d->files_used; s->nchunks=nch;
+        s->chunks=xrealloc(NULL,(size_t)(nch?nch:1)*sizeof(SnapChunk*));
+        for(int c=0;c<nch;c++){
+            if(o&&c<o->nchunks&&o->chunks[c]->gen==d->cgen[c]){ s->chunks[c]=o->chunks[c]; atomic_fetch_add(&s->chunks[c]->refs,1); continue; }
+            int n=d->files_used-c*SNAP_CHUNK; if(n>SNAP_CHUNK) n=SNAP_CHUNK;
+            SnapChunk *k=xrealloc(NULL,sizeof(SnapChunk)); atomic_init(&k->refs,1); k->gen=d->cgen[c]; k->n=n;
+            memcpy(k->files,d->files+(size_t)c*SNAP_CHUNK,(size_t)n*sizeof(FileMeta)); s->chunks[c]=k;
+        }
+        snap_unref(o); d->snap=s;
+    }
+    atomic_fetch_add(&d->snap->refs,1); return d->snap;
+}
+static void dss_release(int di){
+    DSS *d=&g_dss[di];
+    for(int k=0;k<d->n;k++) if(d->disk[k]>=0) disk_release(d->disk[k]);
+    ni_del(&g_dss_idx,d->name); ni_free(&d->file_idx); free(d->files); free(d->cgen); free(d->disk); free(d->leases);
+    snap_unref(d->snap); pthread_mutex_destroy(d->mu); free(d->mu);
+    slot_release(g_dss,sizeof(DSS),di,&g_dss_free,offsetof(DSS,next_free));
+}
+// new DSS on the given member disks (slots, all free)
+static int dss_create(const char *name, int n, int su, const int *members){
+    int di=dss_new_slot(); DSS *d=&g_dss[di];
+    d->used=1; d->inc=++g_dss_inc; snprintf(d->name,NAME,"%s",name); d->n=n; d->striping_unit=su; d->recovering=-1;
+    d->disk=xrealloc(NULL,(size_t)n*sizeof(int));
+    d->mu=xrealloc(NULL,sizeof(pthread_mutex_t)); pthread_mutex_init(d->mu,NULL);
+    ni_put(&g_dss_idx,d->name,di);
+    for(int k=0;k<n;k++){
+        int i=d->disk[k]=members[k]; pool_unlink(i); g_disks[i].state=D_IN_USE; snprintf(g_disks[i].assigned_to,NAME,"%s",name);
+    }
+    return di;
+}
+static void file_commit(DSS *d, const char *fname, const char *owner, long long size){
+    int fi=dss_file_put(d,fname);
+    snprintf(d->files[fi].owner,NAME,"%s",owner); d->files[fi].fsize=size;
+    int c=fi/SNAP_CHUNK;
+    if(c>=d->cgen_cap){ int nc=d->cgen_cap?d->cgen_cap*2:4; while(nc<=c) nc*=2; d->cgen=xrealloc(d->cgen,(size_t)nc*sizeof(*d->cgen)); memset(d->cgen+d->cgen_cap,0,(size_t)(nc-d->cgen_cap)*sizeof(*d->cgen)); d->cgen_cap=nc; }
+    d->cgen[c]=++d->gen;
+}
 
-int main(int argc, char **argv){
-    nobuf();
-    if(argc!=2){ fprintf(stderr,"usage: manager <manager_listen_port>\n"); return 1; }
-    int port=atoi(argv[1]); if(port<=0||port>65535){ fprintf(stderr,"invalid port: %s\n",argv[1]); return 1; }
+// write-ahead log (--wal=<dir>): every state change -- register/deregister, configure-dss,
+// copy-complete, decommission-dss -- is appended to <dir>/manager.wal while its handler still
+// holds the locks, so log order is state order. record: u32 body length, u32 crc32c(body),
+// body = u64 lsn, u8 type, fields (u16-length strings, little-endian u64s).
+// group commit: records collect in memory; a worker makes its records durable once per
+// receive batch, before that batch's replies go out, and the fdatasync() covers whatever
+// every worker had buffered by then. --fsync=<ms> writes at batch end and syncs from a
+// background thread every <ms> instead; --fsync=off writes but never syncs.
+// every --snap-every records the state is written compactly to <dir>/manager.snap, tagged
+// with the lsn it covers, and the log restarts empty; startup loads the snapshot and replays
+// the log records past it.
+enum { W_USER=1, W_DISK, W_UNUSER, W_UNDISK, W_DSS, W_FILE, W_UNDSS };
+#define WAL_HDR 16 // u32 len, u32 crc, u64 lsn
+typedef struct { unsigned char *p; size_t n, cap; } Buf;
+static void buf_put(Buf *b, const void *src, size_t n){ if(b->n+n>b->cap){ b->cap=(b->n+n)*2+256; b->p=xrealloc(b->p,b->cap); } memcpy(b->p+b->n,src,n); b->n+=n; }
+static void put_u8(Buf *b, unsigned v){ unsigned char c=(unsigned char)v; buf_put(b,&c,1); }
+static void put_u64(Buf *b, uint64_t v){ v=htole64(v); buf_put(b,&v,8); }
+static void put_str(Buf *b, const char *s){ size_t n=strlen(s); uint16_t l=htole16((uint16_t)n); buf_put(b,&l,2); buf_put(b,s,n); }
+typedef struct { const unsigned char *p, *end; int bad; } Rd;
+static unsigned get_u8(Rd *r){ if(r->p+1>r->end){ r->bad=1; return 0; } return *r->p++; }
+static uint64_t get_u64(Rd *r){ uint64_t v; if(r->p+8>r->end){ r->bad=1; return 0; } memcpy(&v,r->p,8); r->p+=8; return le64toh(v); }
+static void get_str(Rd *r, char *out, size_t sz){
+    uint16_t l; out[0]='\0';
+    if(r->p+2>r->end){ r->bad=1; return; }
+    memcpy(&l,r->p,2); l=le16toh(l); r->p+=2;
+    if(r->p+l>r->end){ r->bad=1; return; }
+    size_t c=l<sz-1?l:sz-1; memcpy(out,r->p,c); out[c]='\0'; r->p+=l;
+}
 
-    int sock=socket(AF_INET,SOCK_DGRAM,0); if(sock<0){ perror("socket"); return 1; }
-    int yes=1; setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
-    struct sockaddr_in addr; memset(&addr,0,sizeof(addr));
-    addr.sin_family=AF_INET; addr.sin_addr.s_addr=htonl(INADDR_ANY); addr.sin_port=htons((uint16_t)port);
-    if(bind(sock,(struct sockaddr*)&addr,sizeof(addr))<0){ perror("bind"); close(sock); return 1; }
+static struct {
+    int fd, dfd, sync_ms;       // fd<0: no WAL. sync_ms: 0 fsync per batch, >0 periodic, <0 never
+    pthread_mutex_t mu, io;     // mu: buf/next; io: writing the file (taken before mu)
+    Buf buf, spare;             // spare: the buffer being written, swapped with buf under io
+    uint64_t next, written, durable, snap_lsn;
+    long snap_every, since_snap;
+} wal={.fd=-1,.dfd=-1,.mu=PTHREAD_MUTEX_INITIALIZER,.io=PTHREAD_MUTEX_INITIALIZER,.snap_every=100000};
+static __thread Buf wal_rec; static __thread uint64_t wal_mine, wal_mine_done;
 
+static Buf* wal_begin(int type){ wal_rec.n=0; unsigned char z[WAL_HDR]={0}; buf_put(&wal_rec,z,WAL_HDR); put_u8(&wal_rec,(unsigned)type); return &wal_rec; }
+static void wal_end(void){
+    if(wal.fd<0) return;
+    uint32_t len=htole32((uint32_t)(wal_rec.n-8));
+    pthread_mutex_lock(&wal.mu);
+    uint64_t lsn=++wal.next, le=htole64(lsn);
+    memcpy(wal_rec.p,&len,4); memcpy(wal_rec.p+8,&le,8);
+    uint32_t crc=htole32(crc32c(0,wal_rec.p+8,wal_rec.n-8)); memcpy(wal_rec.p+4,&crc,4);
+    buf_put(&wal.buf,wal_rec.p,wal_rec.n); wal.since_snap++;
+    pthread_mutex_unlock(&wal.mu);
+    wal_mine=lsn;
+}
+// get every record up to `upto` into the file, and onto the disk when sync is set
+static void wal_flush(uint64_t upto, int sync){
+    pthread_mutex_lock(&wal.io);
+    if(wal.written<upto){
+        pthread_mutex_lock(&wal.mu);
+        Buf t=wal.buf; wal.buf=wal.spare; wal.spare=t; uint64_t last=wal.next;
+        pthread_mutex_unlock(&wal.mu);
+        for(size_t w=0;w<wal.spare.n;){ ssize_t k=write(wal.fd,wal.spare.p+w,wal.spare.n-w); if(k<=0){ perror("wal write"); exit(1); } w+=(size_t)k; }
+        wal.spare.n=0; wal.written=last;
+    }
+    if(sync&&wal.durable<wal.written){ if(fdatasync(wal.fd)<0){ perror("wal fdatasync"); exit(1); } wal.durable=wal.written; }
+    pthread_mutex_unlock(&wal.io);
+}
+// end of a worker's batch: its records reach the file (and the disk, by policy) before its replies
+static void wal_commit(void){
+    if(wal.fd<0||wal_mine<=wal_mine_done) return;
+    wal_flush(wal_mine,wal.sync_ms==0); wal_mine_done=wal_mine;
+}
+static void* wal_syncer(void *arg){
+    (void)arg;
     for(;;){
-        char buf[BUFSZ]; struct sockaddr_in src; socklen_t slen=sizeof(src);
-        ssize_t n=recvfrom(sock,buf,sizeof(buf)-1,0,(struct sockaddr*)&src,&slen);
-        if(n<0){ perror("recvfrom"); continue; }
-        buf[n]='\0'; trim(buf);
-
-        char ip[INET_ADDRSTRLEN]; inet_ntop(AF_INET,&src.sin_addr,ip,sizeof(ip));
-        unsigned src_port=ntohs(src.sin_port);
-        printf("%s:%u | %s\n",ip,src_port,buf);
-
-        char uline[BUFSZ]; strncpy(uline,buf,sizeof(uline)-1); uline[sizeof(uline)-1]='\0';
-        char linecpy[BUFSZ]; strncpy(linecpy,buf,sizeof(linecpy)-1); linecpy[sizeof(linecpy)-1]='\0';
-
-        char *tokens[64]; int ntok=0; char *save=NULL;
-        for(char *t=strtok_r(uline," \t\r\n",&save); t&&ntok<64; t=strtok_r(NULL," \t\r\n",&save)) tokens[ntok++]=t;
-        if(ntok==0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-
-        char cmd0[64]="",cmd1[64]="";
-        strncpy(cmd0,tokens[0],sizeof(cmd0)-1); strtoupper(cmd0);
-        if(ntok>=2){ strncpy(cmd1,tokens[1],sizeof(cmd1)-1); strtoupper(cmd1); }
-
-        if((strcmp(cmd0,"REGISTER")==0&&strcmp(cmd1,"USER")==0)||strcasecmp(tokens[0],"register-user")==0){
-            char name[NAME]="",ipstr[IPSTR]=""; char tmp[64]; int mport=0,cport=0;
-            if(kvget(linecpy,"name",name,sizeof(name))){
-                kvget(linecpy,"ip",ipstr,sizeof(ipstr));
-                if(kvget(linecpy,"mport",tmp,sizeof(tmp))) mport=atoi(tmp);
-                if(kvget(linecpy,"cport",tmp,sizeof(tmp))) cport=atoi(tmp);
-            }else{
-                int off=(strcmp(cmd0,"REGISTER")==0?2:1);
-                if(ntok>=off+4){ snprintf(name,sizeof(name),"%s",tokens[off]); snprintf(ipstr,sizeof(ipstr),"%s",tokens[off+1]); mport=atoi(tokens[off+2]); cport=atoi(tokens[off+3]); }
-            }
-            if(!name[0]||!ipstr[0]||mport<=0||cport<=0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            int rc=add_user(name,ipstr,mport,cport);
-            if(rc==0){ send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS"); }
-            else if(rc==-2){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); }
-            else{ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); }
-            continue;
-        }
+        struct timespec ts={wal.sync_ms/1000,(long)(wal.sync_ms%1000)*1000000L}; nanosleep(&ts,NULL);
+        pthread_mutex_lock(&wal.mu); uint64_t upto=wal.next; pthread_mutex_unlock(&wal.mu);
+        wal_flush(upto,1);
+    }
+    return NULL;
+}
 
-        if((strcmp(cmd0,"REGISTER")==0&&strcmp(cmd1,"DISK")==0)||strcasecmp(tokens[0],"register-disk")==0){
-            char name[NAME]="",ipstr[IPSTR]=""; char tmp[64]; int mport=0,cport=0;
-            if(kvget(linecpy,"name",name,sizeof(name))){
-                kvget(linecpy,"ip",ipstr,sizeof(ipstr));
-                if(kvget(linecpy,"mport",tmp,sizeof(tmp))) mport=atoi(tmp);
-                if(kvget(linecpy,"cport",tmp,sizeof(tmp))) cport=atoi(tmp);
-            }else{
-                int off=(strcmp(cmd0,"REGISTER")==0?2:1);
-                if(ntok>=off+4){ snprintf(name,sizeof(name),"%s",tokens[off]); snprintf(ipstr,sizeof(ipstr),"%s",tokens[off+1]); mport=atoi(tokens[off+2]); cport=atoi(tokens[off+3]); }
-            }
-            if(!name[0]||!ipstr[0]||mport<=0||cport<=0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            int rc=add_disk(name,ipstr,mport,cport);
-            if(rc==0){ send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS"); }
-            else if(rc==-2){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); }
-            else{ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); }
-            continue;
+// snapshot: magic, lsn, then users, disks (slot order, so the free pool keeps its order) and
+// DSSes with members and files; a trailing crc32c covers it all. g_reg held for writing
+#define SNAP_MAGIC "DSSMSNP1"
+static void wal_snapshot(void){
+    double t0=now_sec();
+    pthread_mutex_lock(&wal.mu); uint64_t lsn=wal.next; pthread_mutex_unlock(&wal.mu);
+    wal_flush(lsn,1);
+    Buf b={0}; long nfiles=0; int nu=0, nd=0, ns=0;
+    buf_put(&b,SNAP_MAGIC,8); put_u64(&b,lsn);
+    for(int i=0;i<g_users_n;i++) if(g_users[i].used) nu++;
+    put_u64(&b,(uint64_t)nu);
+    for(int i=0;i<g_users_n;i++) if(g_users[i].used){ put_str(&b,g_users[i].name); put_str(&b,g_users[i].ip); put_u64(&b,(uint64_t)g_users[i].mport); put_u64(&b,(uint64_t)g_users[i].cport); }
+    for(int i=0;i<g_disks_n;i++) if(g_disks[i].used) nd++;
+    put_u64(&b,(uint64_t)nd);
+    for(int i=0;i<g_disks_n;i++) if(g_disks[i].used){ put_str(&b,g_disks[i].name); put_str(&b,g_disks[i].ip); put_u64(&b,(uint64_t)g_disks[i].mport); put_u64(&b,(uint64_t)g_disks[i].cport); }
+    for(int i=0;i<g_dss_n;i++) if(g_dss[i].used) ns++;
+    put_u64(&b,(uint64_t)ns);
+    for(int i=0;i<g_dss_n;i++){
+        DSS *d=&g_dss[i]; if(!d->used) continue;
+        put_str(&b,d->name); put_u64(&b,(uint64_t)d->n); put_u64(&b,(uint64_t)d->striping_unit);
+        for(int k=0;k<d->n;k++) put_str(&b,g_disks[d->disk[k]].name);
+        put_u64(&b,(uint64_t)d->files_used); nfiles+=d->files_used;
+        for(int f=0;f<d->files_used;f++){ put_str(&b,d->files[f].fname); put_str(&b,d->files[f].owner); put_u64(&b,(uint64_t)d->files[f].fsize); }
+    }
+    uint32_t crc=htole32(crc32c(0,b.p,b.n)); buf_put(&b,&crc,4);
+    int fd=openat(wal.dfd,"manager.snap.tmp",O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(fd<0){ perror("snapshot"); free(b.p); return; }
+    for(size_t w=0;w<b.n;){ ssize_t k=write(fd,b.p+w,b.n-w); if(k<=0){ perror("snapshot write"); close(fd); free(b.p); return; } w+=(size_t)k; }
+    if(fsync(fd)<0||renameat(wal.dfd,"manager.snap.tmp",wal.dfd,"manager.snap")<0||fsync(wal.dfd)<0){ perror("snapshot"); close(fd); free(b.p); return; }
+    close(fd);
+    // the log before lsn is now redundant (replay skips it even if this truncate is lost)
+    pthread_mutex_lock(&wal.io);
+    if(ftruncate(wal.fd,0)<0) perror("wal truncate");
+    pthread_mutex_unlock(&wal.io);
+    wal.snap_lsn=lsn; wal.since_snap=0;
+    LOGF(LOG_INFO,"wal: snapshot at lsn %llu: %d users, %d disks, %d dss, %ld files, %zu bytes in %.3f s",(unsigned long long)lsn,nu,nd,ns,nfiles,b.n,now_sec()-t0);
+    free(b.p);
+}
+static void wal_maybe_snapshot(void){
+    if(wal.fd<0||wal.since_snap<wal.snap_every) return;
+    pthread_rwlock_wrlock(&g_reg);
+    if(wal.since_snap>=wal.snap_every) wal_snapshot();
+    pthread_rwlock_unlock(&g_reg);
+}
+
+// apply one logged change (replay); 0 if the record did not parse
+static int wal_apply(Rd *r){
+    char a[NAME], b[IPSTR], c[NAME];
+    switch(get_u8(r)){
+    case W_USER: case W_DISK: {
+        int disk=r->p[-1]==W_DISK; get_str(r,a,sizeof(a)); get_str(r,b,sizeof(b)); int mp=(int)get_u64(r), cp=(int)get_u64(r);
+        if(!r->bad){ if(disk) add_disk(a,b,mp,cp); else add_user(a,b,mp,cp); }
+        break; }
+    case W_UNUSER: get_str(r,a,sizeof(a)); if(!r->bad) free_user(a); break;
+    case W_UNDISK: get_str(r,a,sizeof(a)); if(!r->bad) free_disk(a); break;
+    case W_DSS: {
+        get_str(r,a,sizeof(a)); int n=(int)get_u64(r), su=(int)get_u64(r);
+        if(r->bad||n<1||n>65536) return 0;
+        int *mem=xrealloc(NULL,(size_t)n*sizeof(int)), ok=dss_index(a)<0;
+        for(int k=0;k<n;k++){ get_str(r,c,sizeof(c)); mem[k]=disk_index(c); if(mem[k]<0||g_disks[mem[k]].state!=D_FREE) ok=0; }
+        if(!r->bad&&ok) dss_create(a,n,su,mem);
+        free(mem); break; }
+    case W_FILE: {
+        char f[NAME]; get_str(r,a,sizeof(a)); get_str(r,f,sizeof(f)); get_str(r,c,sizeof(c)); long long sz=(long long)get_u64(r);
+        int di=dss_index(a); if(!r->bad&&di>=0) file_commit(&g_dss[di],f,c,sz);
+        break; }
+    case W_UNDSS: { get_str(r,a,sizeof(a)); int di=dss_index(a); if(!r->bad&&di>=0) dss_release(di); break; }
+    default: return 0;
+    }
+    return !r->bad;
+}
+
+static unsigned char* read_file(int dfd, const char *name, size_t *len){
+    int fd=openat(dfd,name,O_RDONLY); if(fd<0) return NULL;
+    struct stat st; if(fstat(fd,&st)<0){ close(fd); return NULL; }
+    unsigned char *p=xrealloc(NULL,(size_t)st.st_size+1); size_t got=0;
+    while(got<(size_t)st.st_size){ ssize_t k=read(fd,p+got,(size_t)st.st_size-got); if(k<=0) break; got+=(size_t)k; }
+    close(fd); *len=got; return p;
+}
+
+// --wal=<dir>: load the snapshot, replay the log past it (a torn tail is cut off), open for append
+static int wal_open(const char *dir){
+    double t0=now_sec(); long snap_ents=0, replayed=0;
+    if(mkdir(dir,0755)<0&&errno!=EEXIST){ perror(dir); return -1; }
+    if((wal.dfd=open(dir,O_RDONLY|O_DIRECTORY))<0){ perror(dir); return -1; }
+    size_t len; unsigned char *p=read_file(wal.dfd,"manager.snap",&len);
+    if(p){
+        uint32_t crc; if(len>=20) memcpy(&crc,p+len-4,4);
+        if(len<20||memcmp(p,SNAP_MAGIC,8)!=0||le32toh(crc)!=crc32c(0,p,len-4)){ fprintf(stderr,"wal: %s/manager.snap is damaged\n",dir); free(p); return -1; }
+        Rd r={p+8,p+len-4,0}; wal.snap_lsn=get_u64(&r); char a[NAME], b[IPSTR];
+        for(long i=0,n=(long)get_u64(&r);i<n&&!r.bad;i++){ get_str(&r,a,sizeof(a)); get_str(&r,b,sizeof(b)); int mp=(int)get_u64(&r), cp=(int)get_u64(&r); add_user(a,b,mp,cp); snap_ents++; }
+        for(long i=0,n=(long)get_u64(&r);i<n&&!r.bad;i++){ get_str(&r,a,sizeof(a)); get_str(&r,b,sizeof(b)); int mp=(int)get_u64(&r), cp=(int)get_u64(&r); add_disk(a,b,mp,cp); snap_ents++; }
+        for(long i=0,n=(long)get_u64(&r);i<n&&!r.bad;i++){
+            get_str(&r,a,sizeof(a)); int dn=(int)get_u64(&r), su=(int)get_u64(&r);
+            if(dn<1||dn>65536){ r.bad=1; break; }
+            int *mem=xrealloc(NULL,(size_t)dn*sizeof(int));
+            for(int k=0;k<dn;k++){ get_str(&r,b,sizeof(b)); mem[k]=disk_index(b); if(mem[k]<0) r.bad=1; }
+            if(r.bad){ free(mem); break; }
+            DSS *d=&g_dss[dss_create(a,dn,su,mem)]; free(mem); snap_ents++;
+            for(long f=0,nf=(long)get_u64(&r);f<nf&&!r.bad;f++){ char fn[NAME], ow[NAME]; get_str(&r,fn,sizeof(fn)); get_str(&r,ow,sizeof(ow)); long long sz=(long long)get_u64(&r); file_commit(d,fn,ow,sz); snap_ents++; }
         }
+        free(p);
+        if(r.bad){ fprintf(stderr,"wal: %s/manager.snap is damaged\n",dir); return -1; }
+    }
+    wal.next=wal.snap_lsn;
+    p=read_file(wal.dfd,"manager.wal",&len); size_t good=0;
+    while(p&&good+WAL_HDR<=len){
+        uint32_t blen, crc; memcpy(&blen,p+good,4); memcpy(&crc,p+good+4,4); blen=le32toh(blen);
+        if(blen<9||good+8+blen>len||le32toh(crc)!=crc32c(0,p+good+8,blen)) break;
+        Rd r={p+good+8,p+good+8+blen,0}; uint64_t lsn=get_u64(&r);
+        if(lsn>wal.snap_lsn){ if(!wal_apply(&r)) break; replayed++; wal.since_snap++; }
+        if(lsn>wal.next) wal.next=lsn;
+        good+=8+blen;
+    }
+    free(p);
+    if((wal.fd=openat(wal.dfd,"manager.wal",O_WRONLY|O_CREAT|O_APPEND,0644))<0){ perror("manager.wal"); return -1; }
+    if(good<len){ fprintf(stderr,"wal: dropping %zu bytes of torn/invalid log tail\n",len-good); if(ftruncate(wal.fd,(off_t)good)<0){ perror("wal truncate"); return -1; } }
+    wal.written=wal.durable=wal.next;
+    double el=now_sec()-t0;
+    LOGF(LOG_INFO,"wal: %ld snapshot entries + %ld log records replayed in %.3f s (%.0f records/s), lsn %llu",snap_ents,replayed,el,el>0?(snap_ents+replayed)/el:0.0,(unsigned long long)wal.next);
+    if(wal.sync_ms>0){ pthread_t th; if(pthread_create(&th,NULL,wal_syncer,NULL)!=0){ perror("pthread_create"); return -1; } pthread_detach(th); }
+    return 0;
+}
 
-        if((strcmp(cmd0,"CONFIGURE")==0&&strcmp(cmd1,"DSS")==0)||strcasecmp(tokens[0],"configure-dss")==0){
-            char dss_name[NAME]=""; char tn[32]="",tsu[32]="";
-            if(!kvget(linecpy,"dss",dss_name,sizeof(dss_name))){
-                int off=(strcmp(cmd0,"CONFIGURE")==0?2:1);
-                if(ntok>=off+3){ snprintf(dss_name,sizeof(dss_name),"%s",tokens[off]); snprintf(tn,sizeof(tn),"%s",tokens[off+1]); snprintf(tsu,sizeof(tsu),"%s",tokens[off+2]); }
-            }else{
-                kvget(linecpy,"n",tn,sizeof(tn));
-                kvget(linecpy,"strip",tsu,sizeof(tsu));
-            }
-            int nreq=atoi(tn), su=atoi(tsu);
-            if(!dss_name[0]||nreq<3||!is_power_of_two(su)||su<128||su>1048576||dss_index(dss_name)>=0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            int free_count=0; for(int i=0;i<MAX_DISKS;i++) if(g_disks[i].used&&g_disks[i].state==D_FREE) free_count++;
-            if(free_count<nreq){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            int di=dss_new_slot(); if(di<0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            g_dss[di].used=1; snprintf(g_dss[di].name,NAME,"%s",dss_name); g_dss[di].n=nreq; g_dss[di].striping_unit=su; g_dss[di].files_used=0; g_dss[di].copy_in_progress=0; g_dss[di].read_in_progress=0;
-            int taken=0;
-            for(int i=0;i<MAX_DISKS&&taken<nreq;i++) if(g_disks[i].used&&g_disks[i].state==D_FREE){
-                snprintf(g_dss[di].disk_name[taken],NAME,"%s",g_disks[i].name);
-                g_disks[i].state=D_IN_USE; snprintf(g_disks[i].assigned_to,NAME,"%s",dss_name);
-                taken++;
-            }
-            if(taken!=nreq){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS");
-            continue;
+static int is_power_of_two(int x){ return x>0 && (x&(x-1))==0; }
+
+// requests are parsed in place in one pass: the line is split into tokens at whitespace and
+// every key=value token is split at its '=' (tok[] keeps the key), so handlers read
+// arguments straight out of the receive buffer. pos indexes the first positional argument
+// after the command word(s), for the "REGISTER USER name ip mport cport" forms.
+// a request may open with "#<id> ": every reply line then carries that tag and the reply is
+// closed by "#<id> DONE|lines=N", so a client can pipeline requests and knows when (and
+// whether all of) a reply arrived without waiting out a timeout. untagged requests are
+// answered as before
+#define MAX_TOK 64
+#define MAX_KV 32
+#define ID_MAX 32
+typedef struct {
+    int sock; const struct sockaddr *src; socklen_t slen;
+    const char *id; int nreply, failed;
+    char *tok[MAX_TOK]; int ntok, pos;
+    const char *key[MAX_KV], *val[MAX_KV]; int nkv;
+} Req;
+
+static int parse_req(char *line, Req *r){
+    r->ntok=r->nkv=0;
+    for(char *p=line;*p;){
+        while(*p&&isspace((unsigned char)*p)) p++;
+        if(!*p) break;
+        char *t=p, *eq=NULL;
+        while(*p&&!isspace((unsigned char)*p)){ if(*p=='='&&!eq) eq=p; p++; }
+        if(*p) *p++='\0';
+        if(r->ntok<MAX_TOK) r->tok[r->ntok++]=t;
+        if(eq&&r->nkv<MAX_KV){ *eq='\0'; r->key[r->nkv]=t; r->val[r->nkv++]=eq+1; }
+    }
+    return r->ntok;
+}
+static const char* arg(const Req *r, const char *key){ for(int i=0;i<r->nkv;i++) if(strcmp(r->key[i],key)==0) return r->val[i]; return NULL; }
+static const char* argd(const Req *r, const char *key){ const char *v=arg(r,key); return v?v:""; }
+static const char* posarg(const Req *r, int i){ return r->pos+i<r->ntok?r->tok[r->pos+i]:NULL; }
+static int is_failure(const char *fmt, ...){ return strncmp(fmt,"FAILURE",7)==0; }
+#define REPLY(r,...) ((r)->nreply++, (r)->failed|=is_failure(__VA_ARGS__), send_line((r)->sock,(r)->src,(r)->slen,(r)->id,__VA_ARGS__))
+
+static void h_register(Req *r, int disk){
+    const char *name=arg(r,"name"), *ipstr; int mport=0,cport=0;
+    if(name){
+        ipstr=argd(r,"ip"); mport=atoi(argd(r,"mport")); cport=atoi(argd(r,"cport"));
+    }else{
+        name=posarg(r,0); ipstr=posarg(r,1);
+        if(!posarg(r,3)) name=NULL;
+        else{ mport=atoi(posarg(r,2)); cport=atoi(posarg(r,3)); }
+    }
+    if(!name||!name[0]||!ipstr[0]||mport<=0||cport<=0){ REPLY(r,"FAILURE"); return; }
+    int rc=disk?add_disk(name,ipstr,mport,cport):add_user(name,ipstr,mport,cport);
+    if(rc==0){ Buf *w=wal_begin(disk?W_DISK:W_USER); put_str(w,name); put_str(w,ipstr); put_u64(w,(uint64_t)mport); put_u64(w,(uint64_t)cport); wal_end(); }
+    REPLY(r,rc==0?"SUCCESS":"FAILURE");
+}
+static void h_register_user(Req *r){ h_register(r,0); }
+static void h_register_disk(Req *r){ h_register(r,1); }
+
+// placement: configure-dss ranks the free disks by their last heartbeat -- free space as a
+// share of the roomiest candidate's (weight PLACE_W_FREE) plus idleness, 1 - recent I/O
+// rate over the busiest candidate's. a disk never heard from scores a neutral 0.5 on both;
+// one silent for HB_STALE_SEC goes last. members are then dealt round-robin over hosts: the
+// best disk of every IP before a second disk of any, so a DSS shares a host only when there
+// are fewer hosts than members. equal scores keep registration (pool) order
+#define PLACE_W_FREE 0.6
+#define HB_STALE_SEC 5.0
+typedef struct { int disk, ord; double score; } Cand;
+static int cand_cmp(const void *a, const void *b){
+    const Cand *x=a, *y=b;
+    return x->score<y->score?1:x->score>y->score?-1:x->ord-y->ord;
+}
+// pick n free disks into out[]; returns the number of distinct hosts used (caller holds g_reg)
+static int place(int n, int *out, double *score){
+    Cand *c=xrealloc(NULL,(size_t)g_pool_n*sizeof(Cand)); int nc=0;
+    double t=now_sec(), max_free=0, max_io=0;
+    for(int i=g_pool_head;i>=0;i=g_disks[i].pool_next){
+        const Disk *d=&g_disks[i];
+        if(d->hb_at>0&&t-d->hb_at<HB_STALE_SEC){ if(d->cap-d->stored>max_free) max_free=(double)(d->cap-d->stored); if(d->io_bps>max_io) max_io=d->io_bps; }
+        c[nc].disk=i; c[nc].ord=nc; nc++;
+    }
+    for(int k=0;k<nc;k++){
+        const Disk *d=&g_disks[c[k].disk]; double fr=0.5, idle=0.5;
+        if(d->hb_at>0&&t-d->hb_at>=HB_STALE_SEC){ c[k].score=-1; continue; }
+        if(d->hb_at>0){ fr=max_free>0?(double)(d->cap-d->stored)/max_free:1.0; idle=max_io>0?1.0-d->io_bps/max_io:1.0; }
+        c[k].score=PLACE_W_FREE*fr+(1-PLACE_W_FREE)*idle;
+    }
+    qsort(c,(size_t)nc,sizeof(Cand),cand_cmp);
+    NameIdx per_ip={0}; int got=0, hosts=0;
+    for(int round=0;got<n;round++)
+        for(int k=0;k<nc&&got<n;k++){
+            if(c[k].disk<0) continue;
+            const char *ip=g_disks[c[k].disk].ip; int u=ni_get(&per_ip,ip); if(u<0) u=0;
+            if(u!=round) continue;
+            if(!u) hosts++;
+            ni_put(&per_ip,ip,u+1); score[got]=c[k].score; out[got++]=c[k].disk; c[k].disk=-1;
         }
+    ni_free(&per_ip); free(c);
+    return hosts;
+}
+
+// heartbeat name=<disk> cap=<bytes> used=<bytes> io_bps=<bytes/s>: a disk's periodic report
+// over its m-port, feeding placement. one-way, no reply; dropped unless it comes from the
+// address and m-port the disk registered with. the Disk fields it sets are registry state,
+// so it runs under the registry write lock like the rest of the writers
+static void h_heartbeat(Req *r){
+    int i=disk_index(argd(r,"name")); if(i<0) return;
+    Disk *d=&g_disks[i];
+    const struct sockaddr_in *src=(const struct sockaddr_in*)r->src; struct in_addr ip;
+    if(src->sin_family!=AF_INET||ntohs(src->sin_port)!=d->mport||inet_pton(AF_INET,d->ip,&ip)!=1||ip.s_addr!=src->sin_addr.s_addr) return;
+    d->cap=atoll(argd(r,"cap")); d->stored=atoll(argd(r,"used")); d->io_bps=atof(argd(r,"io_bps")); d->hb_at=now_sec();
+}
 
-        if(strcasecmp(tokens[0],"ls")==0){
-            int have=0;
-            for(int i=0;i<MAX_DSS;i++){
-                if(!g_dss[i].used) continue; have=1;
-                char order[NAME*MAX_DISKS]="";
-                for(int k=0;k<g_dss[i].n;k++){ if(k) strncat(order,",",sizeof(order)-strlen(order)-1); strncat(order,g_dss[i].disk_name[k],sizeof(order)-strlen(order)-1); }
-                send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS|DSS=%s|n=%d|su=%d|order=%s",g_dss[i].name,g_dss[i].n,g_dss[i].striping_unit,order);
-                for(int f=0;f<g_dss[i].files_used;f++) send_line(sock,(struct sockaddr*)&src,slen,"FILE|dss=%s|name=%s|size=%lld|owner=%s",g_dss[i].name,g_dss[i].files[f].fname,g_dss[i].files[f].fsize,g_dss[i].files[f].owner);
-            }
-            if(!have) send_line(sock,(struct sockaddr*)&src,slen,"FAILURE");
-            continue;
+static void h_configure_dss(Req *r){
+    const char *dss_name=arg(r,"dss"), *tn="", *tsu="";
+    if(!dss_name){ if(posarg(r,2)){ dss_name=posarg(r,0); tn=posarg(r,1); tsu=posarg(r,2); } else dss_name=""; }
+    else{ tn=argd(r,"n"); tsu=argd(r,"strip"); }
+    int nreq=atoi(tn), su=atoi(tsu);
+    if(!dss_name[0]||nreq<3||!is_power_of_two(su)||su<128||su>1048576||dss_index(dss_name)>=0){ REPLY(r,"FAILURE"); return; }
+    if(g_pool_n<nreq){ REPLY(r,"FAILURE"); return; }
+    int *members=xrealloc(NULL,(size_t)nreq*sizeof(int)); double *score=xrealloc(NULL,(size_t)nreq*sizeof(double));
+    int hosts=place(nreq,members,score); dss_create(dss_name,nreq,su,members);
+    Buf *w=wal_begin(W_DSS); put_str(w,dss_name); put_u64(w,(uint64_t)nreq); put_u64(w,(uint64_t)su);
+    for(int k=0;k<nreq;k++){
+        const Disk *dk=&g_disks[members[k]]; put_str(w,dk->name);
+        notify_disk(r->sock,dk,"DSS|dss=%s|su=%d|k=%d\n",dss_name,su,k);
+        if(dk->hb_at>0) REPLY(r,"PLACE|k=%d|disk=%s|ip=%s|free=%lld|io_bps=%.0f|score=%.3f",k,dk->name,dk->ip,dk->cap-dk->stored,dk->io_bps,score[k]);
+        else REPLY(r,"PLACE|k=%d|disk=%s|ip=%s|score=%.3f",k,dk->name,dk->ip,score[k]);
+    }
+    wal_end();
+    REPLY(r,"SUCCESS|dss=%s|n=%d|su=%d|hosts=%d%s",dss_name,nreq,su,hosts,hosts<nreq?"|shared-hosts":"");
+    free(members); free(score);
+}
+
+// ls [dss=<dss>] [owner=<user>] [prefix=<name-prefix>] [limit=N] [cursor=<c>]: one page of the
+// listing -- a SUCCESS|DSS= line per DSS, then its FILE| lines (filtered here) -- closed by
+// MORE|cursor=<c>|entries=N (ask again with that cursor) or END|entries=N. entries counts the
+// page's lines so the client can tell a datagram went missing and fetch the page again.
+// the cursor is <dss slot>.<file index>.<incarnation> (index -1: the DSS line); files are only
+// ever appended, so an index stays valid between pages, and a slot whose incarnation changed
+// held a DSS that has since been decommissioned, so the listing moves past it. FILE lines
+// come from the DSS's FileSnap, walked with no locks held, and the page is sent after
+#define LS_LIMIT 128
+#define LS_LIMIT_MAX 1024
+#define LS_PAGE_BYTES (24*REPLY_MTU)
+static void h_ls(Req *r){
+    const char *only=arg(r,"dss"), *owner=arg(r,"owner"), *prefix=arg(r,"prefix"), *cur=arg(r,"cursor");
+    int limit=arg(r,"limit")?atoi(arg(r,"limit")):LS_LIMIT, slot=0, fi=-1; unsigned long inc=0;
+    if(limit<1) limit=1;
+    if(limit>LS_LIMIT_MAX) limit=LS_LIMIT_MAX;
+    if(cur&&sscanf(cur,"%d.%d.%lu",&slot,&fi,&inc)!=3){ REPLY(r,"FAILURE bad cursor"); return; }
+    size_t plen=prefix?strlen(prefix):0, bytes=0; int n=0, any=0, more=0;
+    char *page=xrealloc(NULL,LS_PAGE_BYTES+BUFSZ); // NUL-separated lines; each starts under LS_PAGE_BYTES
+    pthread_rwlock_rdlock(&g_reg);
+    if(only){ int di=dss_index(only); if(di<0) slot=g_dss_n; else if(slot<di){ slot=di; fi=-1; } else if(slot>di) slot=g_dss_n; }
+    if(slot<0){ slot=0; fi=-1; }
+    if(cur&&fi>=0&&slot<g_dss_n&&(!g_dss[slot].used||g_dss[slot].inc!=inc)){ if(only) slot=g_dss_n; else{ slot++; fi=-1; } }
+    for(;slot<g_dss_n&&n<limit&&bytes<LS_PAGE_BYTES;slot++,fi=-1){
+        DSS *d=&g_dss[slot]; if(!d->used) continue;
+        any=1; inc=d->inc;
+        char dname[NAME]; snprintf(dname,NAME,"%s",d->name);
+        pthread_mutex_lock(d->mu);
+        if(fi<0){
+            char order[BUFSZ/2]="";
+            for(int k=0;k<d->n;k++){ if(k) strncat(order,",",sizeof(order)-strlen(order)-1); strncat(order,g_disks[d->disk[k]].name,sizeof(order)-strlen(order)-1); }
+            if(d->recovering>=0) snprintf(page+bytes,BUFSZ,"SUCCESS|DSS=%s|n=%d|su=%d|order=%s|recovering=%s|progress=%lld/%lld|mbps=%.1f",d->name,d->n,d->striping_unit,order,g_disks[d->disk[d->recovering]].name,d->rec_done,d->rec_total,d->rec_mbps);
+            else snprintf(page+bytes,BUFSZ,"SUCCESS|DSS=%s|n=%d|su=%d|order=%s",d->name,d->n,d->striping_unit,order);
+            bytes+=strlen(page+bytes)+1; n++; fi=0;
         }
+        FileSnap *snap=dss_snapshot(d);
+        pthread_mutex_unlock(d->mu);
+        pthread_rwlock_unlock(&g_reg);
+        for(;fi<snap->nfiles&&n<limit&&bytes<LS_PAGE_BYTES;fi++){
+            const FileMeta *fm=snap_file(snap,fi);
+            if((owner&&strcmp(fm->owner,owner)!=0)||(prefix&&strncmp(fm->fname,prefix,plen)!=0)) continue;
+            snprintf(page+bytes,BUFSZ,"FILE|dss=%s|name=%s|size=%lld|owner=%s",dname,fm->fname,fm->fsize,fm->owner);
+            bytes+=strlen(page+bytes)+1; n++;
+        }
+        more=fi<snap->nfiles;
+        snap_unref(snap);
+        pthread_rwlock_rdlock(&g_reg);
+        if(more||only) break;
+    }
+    if(!more&&!only) while(slot<g_dss_n&&!g_dss[slot].used) slot++;
+    int done=!more&&(only||slot>=g_dss_n);
+    pthread_rwlock_unlock(&g_reg);
+    if(!any&&!cur){ free(page); REPLY(r,"FAILURE"); return; }
+    for(size_t o=0;o<bytes;o+=strlen(page+o)+1) REPLY(r,"%s",page+o);
+    if(done) REPLY(r,"END|entries=%d",n);
+    else REPLY(r,"MORE|cursor=%d.%d.%lu|entries=%d",slot,fi,inc,n);
+    free(page);
+}
 
+static void send_disk_map(Req *r, const DSS *d){
+    for(int k=0;k<d->n;k++){ const Disk *dk=&g_disks[d->disk[k]]; REPLY(r,"DISK|%d|%s|%s|%d",k,dk->name,dk->ip,dk->cport); }
+}
+// the named DSS with its mutex held, or NULL (caller holds the registry read lock)
+static DSS* dss_lock(const char *name){
+    int di=dss_index(name); if(di<0) return NULL;
+    pthread_mutex_lock(g_dss[di].mu); return &g_dss[di];
+}
 
-if (strcasecmp(tokens[0],"copy")==0){
-    char fname[NAME]="", fsize[32]="", owner[NAME]="", dss_name[NAME]="";
-    kvget(linecpy,"file",fname,sizeof(fname));
-    kvget(linecpy,"size",fsize,sizeof(fsize));
-    kvget(linecpy,"owner",owner,sizeof(owner));
-    kvget(linecpy,"dss",dss_name,sizeof(dss_name));
+// write leases (d->mu held). expired ones are dropped by every lookup, so a client that died
+// mid-copy holds its file for at most one lease term
+static double g_lease_sec=30; static atomic_ullong g_lease_seq;
+static int lease_live(DSS *d){
+    double t=now_sec();
+    for(int i=0;i<d->nleases;){
+        Lease *l=&d->leases[i]; if(l->expires>=t){ i++; continue; }
+        LOGF(LOG_INFO,"lease %llu on %s/%s (owner %s) expired, reclaimed",l->id,d->name,l->fname,l->owner);
+        *l=d->leases[--d->nleases];
+    }
+    return d->nleases;
+}
+static Lease* lease_find(DSS *d, const char *fname){
+    lease_live(d);
+    for(int i=0;i<d->nleases;i++) if(!strcmp(d->leases[i].fname,fname)) return &d->leases[i];
+    return NULL;
+}
+// the caller's lease on fname: the id when it sent one (lease=), else the owner must match
+static Lease* lease_held(DSS *d, Req *r, const char *fname){
+    Lease *l=lease_find(d,fname); const char *id=arg(r,"lease");
+    if(!l||(id?strtoull(id,NULL,10)!=l->id:strcmp(l->owner,argd(r,"owner"))!=0)) return NULL;
+    return l;
+}
+static void lease_drop(DSS *d, Lease *l){ *l=d->leases[--d->nleases]; }
 
-    int di = -1;
-    if (dss_name[0]) di = dss_index(dss_name);
-    if (di < 0) { for (int i=0;i<MAX_DSS;i++) if (g_dss[i].used) { di = i; break; } }
+static void h_copy(Req *r){
+    const char *fname=argd(r,"file"), *fsize=argd(r,"size"), *owner=argd(r,"owner"), *dss_name=argd(r,"dss");
+    int di=dss_name[0]?dss_index(dss_name):-1;
+    for(int i=0;i<g_dss_n&&di<0;i++) if(g_dss[i].used) di=i;
+    if(di<0||!fname[0]||!owner[0]||strlen(fname)>=NAME){ REPLY(r,"FAILURE"); return; }
+    DSS *d=&g_dss[di]; pthread_mutex_lock(d->mu);
+    if(d->recovering>=0){ pthread_mutex_unlock(d->mu); REPLY(r,"FAILURE"); return; }
+    Lease *l=lease_find(d,fname);
+    if(l){ double left=l->expires-now_sec(); char by[NAME]; snprintf(by,sizeof(by),"%s",l->owner); pthread_mutex_unlock(d->mu); REPLY(r,"FAILURE|file=%s|leased-by=%s|expires-in=%.0f",fname,by,left); return; }
+    // rewriting the blocks under a read in progress would tear it
+    int fi=dss_file_index(d,fname), readers=fi>=0?d->files[fi].readers:0;
+    if(readers){ pthread_mutex_unlock(d->mu); REPLY(r,"FAILURE|file=%s|readers=%d",fname,readers); return; }
+    if(d->nleases==d->leases_cap){ d->leases_cap=d->leases_cap?d->leases_cap*2:8; d->leases=xrealloc(d->leases,(size_t)d->leases_cap*sizeof(Lease)); }
+    l=&d->leases[d->nleases++];
+    snprintf(l->fname,NAME,"%s",fname); snprintf(l->owner,NAME,"%s",owner);
+    l->id=atomic_fetch_add(&g_lease_seq,1)+1; l->expires=now_sec()+g_lease_sec;
+    unsigned long long id=l->id;
+    pthread_mutex_unlock(d->mu);
+    send_disk_map(r,d);
+    REPLY(r,"SUCCESS|DSS=%s|n=%d|su=%d|file=%s|size=%s|lease=%llu|ttl=%.0f",d->name,d->n,d->striping_unit,fname,fsize,id,g_lease_sec);
+}
 
-    if (di < 0 || !fname[0] || !owner[0]) { send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-    if (g_dss[di].copy_in_progress) { send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-    // copy (block decommission/failure/read while copying)
-    g_dss[di].copy_in_progress = 1;
+static void h_lease_renew(Req *r){
+    DSS *d=dss_lock(argd(r,"dss")); if(!d){ REPLY(r,"FAILURE"); return; }
+    Lease *l=lease_held(d,r,argd(r,"file"));
+    if(l) l->expires=now_sec()+g_lease_sec;
+    pthread_mutex_unlock(d->mu);
+    REPLY(r,l?"SUCCESS":"FAILURE");
+}
 
-    for (int k=0;k<g_dss[di].n;k++){
-        int dd = disk_index(g_dss[di].disk_name[k]);
-        if (dd>=0) send_line(sock,(struct sockaddr*)&src,slen,"DISK|%d|%s|%s|%d",k,g_disks[dd].name,g_disks[dd].ip,g_disks[dd].cport);
+static void h_copy_abort(Req *r){
+    DSS *d=dss_lock(argd(r,"dss")); if(!d){ REPLY(r,"FAILURE"); return; }
+    Lease *l=lease_held(d,r,argd(r,"file"));
+    if(l) lease_drop(d,l);
+    pthread_mutex_unlock(d->mu);
+    REPLY(r,l?"SUCCESS":"FAILURE");
+}
+
+static void h_copy_complete(Req *r){
+    const char *fname=argd(r,"file"), *owner=argd(r,"owner");
+    if(!fname[0]||!owner[0]){ REPLY(r,"FAILURE"); return; }
+    DSS *d=dss_lock(argd(r,"dss")); if(!d){ REPLY(r,"FAILURE"); return; }
+    // only the lease holder commits: after a reclaim the blocks may belong to a newer upload
+    Lease *l=lease_held(d,r,fname);
+    if(!l){ pthread_mutex_unlock(d->mu); REPLY(r,"FAILURE|file=%s|no-lease",fname); return; }
+    long long size=atoll(argd(r,"size"));
+    file_commit(d,fname,owner,size);
+    Buf *w=wal_begin(W_FILE); put_str(w,d->name); put_str(w,fname); put_str(w,owner); put_u64(w,(uint64_t)size); wal_end();
+    lease_drop(d,l);
+    pthread_mutex_unlock(d->mu);
+    REPLY(r,"SUCCESS");
+}
+
+static void h_read(Req *r){
+    DSS *d=dss_lock(argd(r,"dss")); if(!d){ REPLY(r,"FAILURE"); return; }
+    int fi=dss_file_index(d,argd(r,"file"));
+    if(fi<0||strcmp(d->files[fi].owner,argd(r,"user"))!=0||lease_find(d,d->files[fi].fname)){ pthread_mutex_unlock(d->mu); REPLY(r,"FAILURE"); return; }
+    // read (multiple concurrent reads if needed
+    d->read_in_progress++; d->files[fi].readers++;
+    char fname[NAME]; snprintf(fname,sizeof(fname),"%s",d->files[fi].fname); long long fsize=d->files[fi].fsize;
+    pthread_mutex_unlock(d->mu);
+    send_disk_map(r,d);
+    REPLY(r,"SUCCESS|DSS=%s|n=%d|su=%d|file=%s|size=%lld",d->name,d->n,d->striping_unit,fname,fsize);
+}
+
+static void h_read_complete(Req *r){
+    DSS *d=dss_lock(argd(r,"dss"));
+    if(d){
+        int fi=dss_file_index(d,argd(r,"file"));
+        if(d->read_in_progress>0) d->read_in_progress--;
+        if(fi>=0&&d->files[fi].readers>0) d->files[fi].readers--;
+        pthread_mutex_unlock(d->mu);
     }
-    send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS|DSS=%s|n=%d|su=%d|file=%s|size=%s",
-              g_dss[di].name,g_dss[di].n,g_dss[di].striping_unit,fname,fsize);
-    continue;
+    REPLY(r,"SUCCESS");
 }
 
+static void h_disk_failure(Req *r){
+    static __thread unsigned seed; if(!seed) seed=(unsigned)time(NULL)^(unsigned)(uintptr_t)&seed;
+    const char *dname=argd(r,"disk");
+    DSS *d=dss_lock(argd(r,"dss")); if(!d){ REPLY(r,"FAILURE"); return; }
+    if(d->read_in_progress>0||lease_live(d)||d->recovering>=0){ pthread_mutex_unlock(d->mu); REPLY(r,"FAILURE"); return; }
+    // failed disk: the one named, else a random member
+    int fk=dname[0]?-1:(int)(rand_r(&seed)%(unsigned)d->n);
+    int fd=dname[0]?disk_index(dname):-1;
+    for(int k=0;k<d->n&&fd>=0;k++) if(d->disk[k]==fd) fk=k;
+    if(fk<0){ pthread_mutex_unlock(d->mu); REPLY(r,"FAILURE"); return; }
+    d->recovering=fk; d->rec_done=d->rec_total=0; d->rec_mbps=0;
+    FileSnap *snap=dss_snapshot(d);
+    pthread_mutex_unlock(d->mu);
+    send_disk_map(r,d);
+    for(int f=0;f<snap->nfiles;f++){ const FileMeta *fm=snap_file(snap,f); REPLY(r,"FILE|dss=%s|name=%s|size=%lld|owner=%s",d->name,fm->fname,fm->fsize,fm->owner); }
+    snap_unref(snap);
+    REPLY(r,"SUCCESS|DSS=%s|n=%d|su=%d|failed=%d",d->name,d->n,d->striping_unit,fk);
+}
 
+static void h_recovery_progress(Req *r){
+    DSS *d=dss_lock(argd(r,"dss")); const char *v;
+    if(!d){ REPLY(r,"FAILURE"); return; }
+    int ok=d->recovering>=0;
+    if(ok&&(v=arg(r,"done"))) d->rec_done=atoll(v);
+    if(ok&&(v=arg(r,"total"))) d->rec_total=atoll(v);
+    if(ok&&(v=arg(r,"mbps"))) d->rec_mbps=atof(v);
+    pthread_mutex_unlock(d->mu);
+    REPLY(r,ok?"SUCCESS":"FAILURE");
+}
 
+static void h_recovery_complete(Req *r){
+    const char *bytes=arg(r,"bytes"), *secs=arg(r,"secs");
+    DSS *d=dss_lock(argd(r,"dss")); if(!d){ REPLY(r,"FAILURE"); return; }
+    if(d->recovering<0){ pthread_mutex_unlock(d->mu); REPLY(r,"FAILURE"); return; }
+    if(!bytes) bytes="0";
+    if(!secs) secs="0";
+    double el=atof(secs);
+    LOGF(LOG_INFO,"recovery of %s on %s done: %s bytes in %s s (%.1f MB/s)",g_disks[d->disk[d->recovering]].name,d->name,bytes,secs,el>0?atoll(bytes)/el/1e6:0.0);
+    d->recovering=-1;
+    pthread_mutex_unlock(d->mu);
+    REPLY(r,"SUCCESS");
+}
 
-        if(strcasecmp(tokens[0],"copy-complete")==0){
-            char dss_name[NAME]="",fname[NAME]="",owner[NAME]="",fsize[32]="";
-            kvget(linecpy,"dss",dss_name,sizeof(dss_name));
-            kvget(linecpy,"file",fname,sizeof(fname));
-            kvget(linecpy,"owner",owner,sizeof(owner));
-            kvget(linecpy,"size",fsize,sizeof(fsize));
-            int di=dss_index(dss_name);
-            if(di<0||!fname[0]||!owner[0]){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            if(g_dss[di].files_used>=MAX_FILES){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            int fi=g_dss[di].files_used++;
-            snprintf(g_dss[di].files[fi].fname,NAME,"%s",fname);
-            snprintf(g_dss[di].files[fi].owner,NAME,"%s",owner);
-            g_dss[di].files[fi].fsize=atoll(fsize);
-	    // commit (release copy lock and record metadata
-            g_dss[di].copy_in_progress=0;
-            send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS");
-            continue;
-        }
+static void h_deregister_user(Req *r){
+    const char *name=arg(r,"user"); if(!name) name=posarg(r,0);
+    if(!name||!name[0]||user_index(name)<0){ REPLY(r,"FAILURE"); return; }
+    free_user(name); put_str(wal_begin(W_UNUSER),name); wal_end();
+    REPLY(r,"SUCCESS");
+}
 
-        if(strcasecmp(tokens[0],"read")==0){
-            char dss_name[NAME]="",fname[NAME]="",uname[NAME]="";
-            kvget(linecpy,"dss",dss_name,sizeof(dss_name));
-            kvget(linecpy,"file",fname,sizeof(fname));
-            kvget(linecpy,"user",uname,sizeof(uname));
-            int di=dss_index(dss_name); if(di<0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            int fi=dss_file_index(&g_dss[di],fname);
-            if(fi<0||strcmp(g_dss[di].files[fi].owner,uname)!=0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            if(g_dss[di].copy_in_progress){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-	    // read (multiple concurrent reads if needed 
-            g_dss[di].read_in_progress++;
-            for(int k=0;k<g_dss[di].n;k++){
-                int dd=disk_index(g_dss[di].disk_name[k]);
-                if(dd>=0) send_line(sock,(struct sockaddr*)&src,slen,"DISK|%d|%s|%s|%d",k,g_disks[dd].name,g_disks[dd].ip,g_disks[dd].cport);
-            }
-            send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS|DSS=%s|n=%d|su=%d|file=%s|size=%lld",g_dss[di].name,g_dss[di].n,g_dss[di].striping_unit,g_dss[di].files[fi].fname,g_dss[di].files[fi].fsize);
-            continue;
-        }
+static void h_deregister_disk(Req *r){
+    const char *name=arg(r,"disk"); if(!name) name=posarg(r,0);
+    int di=name?disk_index(name):-1;
+    if(di<0||g_disks[di].state==D_IN_USE){ REPLY(r,"FAILURE"); return; }
+    put_str(wal_begin(W_UNDISK),name); wal_end(); free_disk(name);
+    REPLY(r,"SUCCESS");
+}
 
-        if(strcasecmp(tokens[0],"read-complete")==0){
-            char dss_name[NAME]=""; kvget(linecpy,"dss",dss_name,sizeof(dss_name));
-            int di=dss_index(dss_name); 
-		// read 
-		if(di>=0&&g_dss[di].read_in_progress>0) g_dss[di].read_in_progress--;
-            send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS");
-            continue;
-        }
+static void h_decommission_dss(Req *r){
+    int di=dss_index(argd(r,"dss")); if(di<0){ REPLY(r,"FAILURE"); return; }
+    if(lease_live(&g_dss[di])||g_dss[di].read_in_progress>0||g_dss[di].recovering>=0){ REPLY(r,"FAILURE"); return; }
+    put_str(wal_begin(W_UNDSS),g_dss[di].name); wal_end(); dss_release(di);
+    REPLY(r,"SUCCESS");
+}
 
-        if(strcasecmp(tokens[0],"disk-failure")==0){
-            char dss_name[NAME]=""; kvget(linecpy,"dss",dss_name,sizeof(dss_name));
-            int di=dss_index(dss_name);
-            if(di<0||g_dss[di].read_in_progress>0||g_dss[di].copy_in_progress){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            for(int k=0;k<g_dss[di].n;k++){
-                int dd=disk_index(g_dss[di].disk_name[k]);
-                if(dd>=0) send_line(sock,(struct sockaddr*)&src,slen,"DISK|%d|%s|%s|%d",k,g_disks[dd].name,g_disks[dd].ip,g_disks[dd].cport);
-            }
-            send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS|DSS=%s|n=%d|su=%d",g_dss[di].name,g_dss[di].n,g_dss[di].striping_unit);
-            continue;
-        }
+// command table. two-word forms ("REGISTER USER ...") are looked up as "register-user".
+// names go through a perfect hash: cmd_init() searches for a seed under which FNV-1a puts
+// every command in its own slot, so a lookup is one hash and one compare.
+// lock: what the dispatcher holds on the registry around the handler -- REG_W for commands
+// that add/remove users, disks or DSSes, REG_R for the rest (which take the DSS mutex
+// themselves), REG_NONE for handlers that manage it on their own (ls)
+enum { REG_NONE, REG_R, REG_W };
+typedef void (*Handler)(Req*);
+static void h_stats(Req *r); // below the table it lists
+static const struct { const char *name; Handler fn; int lock; } cmds[]={
+    {"register-user",h_register_user,REG_W}, {"register-disk",h_register_disk,REG_W}, {"configure-dss",h_configure_dss,REG_W},
+    {"ls",h_ls,REG_NONE}, {"copy",h_copy,REG_R}, {"copy-complete",h_copy_complete,REG_R}, {"read",h_read,REG_R}, {"read-complete",h_read_complete,REG_R},
+    {"disk-failure",h_disk_failure,REG_R}, {"recovery-progress",h_recovery_progress,REG_R}, {"recovery-complete",h_recovery_complete,REG_R},
+    {"deregister-user",h_deregister_user,REG_W}, {"deregister-disk",h_deregister_disk,REG_W}, {"decommission-dss",h_decommission_dss,REG_W},
+    {"heartbeat",h_heartbeat,REG_W}, {"lease-renew",h_lease_renew,REG_R}, {"copy-abort",h_copy_abort,REG_R},
+    {"stats",h_stats,REG_NONE},
+};
+#define NCMDS ((int)(sizeof(cmds)/sizeof(cmds[0])))
+// per-command metrics, indexed like cmds[]; requests no command matched count as "unknown".
+// bytes is request bytes
+static Metric cmd_mx[NCMDS], unknown_mx; static double g_started;
+static void h_stats(Req *r){
+    char line[256];
+    for(int i=0;i<=NCMDS;i++){
+        const Metric *m=i<NCMDS?&cmd_mx[i]:&unknown_mx; if(!atomic_load(&m->n)) continue;
+        mx_line(line,sizeof(line),m); REPLY(r,"STAT|cmd=%s|%s",i<NCMDS?cmds[i].name:"unknown",line);
+    }
+    REPLY(r,"SUCCESS|uptime=%.0f",now_sec()-g_started);
+}
+static const char *metrics_path; static int metrics_every=10;
+static void metrics_emit(FILE *f){
+    char lb[64];
+    fprintf(f,"# HELP dss_manager_command_seconds Time from receipt to the handler's return, per command.\n# TYPE dss_manager_command_seconds histogram\n");
+    for(int i=0;i<=NCMDS;i++){
+        const Metric *m=i<NCMDS?&cmd_mx[i]:&unknown_mx; if(!atomic_load(&m->n)) continue;
+        snprintf(lb,sizeof(lb),"cmd=\"%s\"",i<NCMDS?cmds[i].name:"unknown"); mx_prom(f,"dss_manager_command_seconds",lb,m);
+    }
+    fprintf(f,"# HELP dss_manager_command_failures_total Requests answered with FAILURE, per command.\n# TYPE dss_manager_command_failures_total counter\n");
+    for(int i=0;i<=NCMDS;i++){
+        const Metric *m=i<NCMDS?&cmd_mx[i]:&unknown_mx; if(!atomic_load(&m->n)) continue;
+        fprintf(f,"dss_manager_command_failures_total{cmd=\"%s\"} %llu\n",i<NCMDS?cmds[i].name:"unknown",atomic_load(&m->err));
+    }
+    fprintf(f,"# HELP dss_manager_uptime_seconds Seconds since start.\n# TYPE dss_manager_uptime_seconds gauge\ndss_manager_uptime_seconds %.0f\n",now_sec()-g_started);
+}
+static void* metrics_dumper(void *arg){
+    (void)arg;
+    for(;;){ sleep((unsigned)metrics_every); if(mx_dump(metrics_path,metrics_emit)<0) LOGF(LOG_ERR,"metrics: can't write %s: %s",metrics_path,strerror(errno)); }
+    return NULL;
+}
+#define CMD_SLOTS 64
+#define CMD_MAXLEN 32
+static signed char cmd_slot[CMD_SLOTS]; static uint32_t cmd_seed;
 
-        if(strcasecmp(tokens[0],"recovery-complete")==0){
-            send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS");
-            continue;
-        }
+static uint32_t cmd_hash(const char *s, size_t n, uint32_t seed){ uint32_t h=2166136261u^seed; for(size_t i=0;i<n;i++){ h^=(unsigned char)s[i]; h*=16777619u; } return (h^(h>>15))&(CMD_SLOTS-1); }
+static void cmd_init(void){
+    for(cmd_seed=0;;cmd_seed++){
+        memset(cmd_slot,-1,sizeof(cmd_slot)); int ok=1;
+        for(int i=0;i<NCMDS&&ok;i++){ uint32_t h=cmd_hash(cmds[i].name,strlen(cmds[i].name),cmd_seed); if(cmd_slot[h]>=0) ok=0; else cmd_slot[h]=(signed char)i; }
+        if(ok) return;
+    }
+}
+// lower-cases a..b (joined by '-' when b is given) and returns the command index or -1
+static int cmd_lookup(const char *a, const char *b){
+    char k[CMD_MAXLEN]; size_t n=0;
+    for(const char *p=a;*p;p++){ if(n+1>=sizeof(k)) return -1; k[n++]=(char)tolower((unsigned char)*p); }
+    if(b){ if(n+1>=sizeof(k)) return -1; k[n++]='-'; for(const char *p=b;*p;p++){ if(n+1>=sizeof(k)) return -1; k[n++]=(char)tolower((unsigned char)*p); } }
+    k[n]='\0';
+    int i=cmd_slot[cmd_hash(k,n,cmd_seed)];
+    return i>=0&&strcmp(cmds[i].name,k)==0?i:-1;
+}
+// parse + look up; the command index or -1
+static int dispatch_parse(char *line, Req *r){
+    r->id=NULL; r->nreply=r->failed=0;
+    if(*line=='#'){
+        size_t k=strcspn(line," \t");
+        if(k<2||k>ID_MAX) return -1;
+        r->id=line+1; if(line[k]) line[k++]='\0';
+        line+=k;
+    }
+    if(!parse_req(line,r)) return -1;
+    int ci=cmd_lookup(r->tok[0],NULL); r->pos=1;
+    if(ci<0&&r->ntok>=2){ ci=cmd_lookup(r->tok[0],r->tok[1]); r->pos=2; }
+    return ci;
+}
 
-        if((strcmp(cmd0,"DEREGISTER")==0&&strcmp(cmd1,"USER")==0)||strcasecmp(tokens[0],"deregister-user")==0){
-            char name[NAME]="";
-            if(!kvget(linecpy,"user",name,sizeof(name))){
-                int off=(strcmp(cmd0,"DEREGISTER")==0?2:1);
-                if(ntok>=off+1) snprintf(name,sizeof(name),"%s",tokens[off]);
-            }
-            if(!name[0]){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            if(user_index(name)<0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); }
-            else{ free_user(name); send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS"); }
-            continue;
-        }
+// the parser this replaced: two copies of the line, strtok_r, upper-cased command words, a
+// strcasecmp chain and one strstr-based kvget per argument. kept for --bench-parse only
+static const char* legacy_parse(const char *buf){
+    static const char *chain[]={"register-user","register-disk","configure-dss","ls","copy","copy-complete","read","read-complete","disk-failure","recovery-progress","recovery-complete","deregister-user","deregister-disk","decommission-dss"};
+    static const char *keys[]={"name","ip","mport","cport","dss","file","size","owner","user","disk"};
+    char uline[BUFSZ]; strncpy(uline,buf,sizeof(uline)-1); uline[sizeof(uline)-1]='\0';
+    char linecpy[BUFSZ]; strncpy(linecpy,buf,sizeof(linecpy)-1); linecpy[sizeof(linecpy)-1]='\0';
+    char *tokens[64]; int ntok=0; char *save=NULL;
+    for(char *t=strtok_r(uline," \t\r\n",&save); t&&ntok<64; t=strtok_r(NULL," \t\r\n",&save)) tokens[ntok++]=t;
+    if(ntok==0) return NULL;
+    char cmd0[64]="",cmd1[64]="";
+    strncpy(cmd0,tokens[0],sizeof(cmd0)-1); strtoupper(cmd0);
+    if(ntok>=2){ strncpy(cmd1,tokens[1],sizeof(cmd1)-1); strtoupper(cmd1); }
+    const char *hit=NULL;
+    for(size_t i=0;i<sizeof(chain)/sizeof(chain[0])&&!hit;i++) if(strcasecmp(tokens[0],chain[i])==0) hit=chain[i];
+    char v[NAME]; for(size_t i=0;i<sizeof(keys)/sizeof(keys[0]);i++) kvget(linecpy,keys[i],v,sizeof(v));
+    return hit;
+}
 
-        if((strcmp(cmd0,"DEREGISTER")==0&&strcmp(cmd1,"DISK")==0)||strcasecmp(tokens[0],"deregister-disk")==0){
-            char name[NAME]="";
-            if(!kvget(linecpy,"disk",name,sizeof(name))){
-                int off=(strcmp(cmd0,"DEREGISTER")==0?2:1);
-                if(ntok>=off+1) snprintf(name,sizeof(name),"%s",tokens[off]);
-            }
-            int di=disk_index(name);
-            if(di<0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            if(g_disks[di].state==D_IN_USE){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            free_disk(name); send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS");
-            continue;
-        }
+// ./manager --bench-parse <trace>: parse throughput, old vs new, over a recorded command trace
+// (one command per line; manager logs work as-is, the "ip:port | " prefix is skipped)
+static int bench_parse(const char *path){
+    FILE *f=fopen(path,"r"); if(!f){ perror(path); return 1; }
+    char **lines=NULL; size_t n=0, cap=0; char buf[BUFSZ];
+    while(fgets(buf,sizeof(buf),f)){
+        trim(buf); char *p=strstr(buf," | "); p=p?p+3:buf;
+        if(!*p||!isalpha((unsigned char)*p)) continue;
+        if(n==cap){ cap=cap?cap*2:1024; lines=xrealloc(lines,cap*sizeof(*lines)); }
+        lines[n]=strdup(p); if(!lines[n]){ perror("strdup"); return 1; }
+        n++;
+    }
+    fclose(f);
+    if(!n){ fprintf(stderr,"%s: no commands\n",path); return 1; }
+    cmd_init();
+    size_t iters=(2000000+n-1)/n; volatile long sink=0; char work[BUFSZ];
+    struct timespec t0,t1; double el_old, el_new;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    for(size_t it=0;it<iters;it++) for(size_t i=0;i<n;i++) sink+=legacy_parse(lines[i])!=NULL;
+    clock_gettime(CLOCK_MONOTONIC,&t1); el_old=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    for(size_t it=0;it<iters;it++) for(size_t i=0;i<n;i++){
+        size_t len=strlen(lines[i]); memcpy(work,lines[i],len+1); // stands in for the datagram landing in rbuf
+        Req r; int ci=dispatch_parse(work,&r);
+        if(ci>=0) for(int k=0;k<r.nkv;k++) sink+=*r.val[k];
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t1); el_new=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+    double total=(double)iters*n;
+    printf("trace: %zu commands x %zu passes\n",n,iters);
+    printf("legacy  %10.0f cmds/s  %7.1f ns/cmd\n",total/el_old,el_old/total*1e9);
+    printf("table   %10.0f cmds/s  %7.1f ns/cmd  (%.1fx)\n",total/el_new,el_new/total*1e9,el_old/el_new);
+    for(size_t i=0;i<n;i++) free(lines[i]);
+    free(lines); return 0;
+}
 
-        if(strcasecmp(tokens[0],"decommission-dss")==0){
-            char dss_name[NAME]=""; kvget(linecpy,"dss",dss_name,sizeof(dss_name));
-            int di=dss_index(dss_name); if(di<0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            if(g_dss[di].copy_in_progress||g_dss[di].read_in_progress>0){ send_line(sock,(struct sockaddr*)&src,slen,"FAILURE"); continue; }
-            for(int k=0;k<g_dss[di].n;k++){
-                int dd=disk_index(g_dss[di].disk_name[k]);
-                if(dd>=0){ g_disks[dd].state=D_FREE; g_disks[dd].assigned_to[0]='\0'; }
-            }
-            memset(&g_dss[di],0,sizeof(DSS));
-            send_line(sock,(struct sockaddr*)&src,slen,"SUCCESS");
-            continue;
+// workers: each owns a SO_REUSEPORT socket on the manager port and runs the recvmmsg() loop
+// with its own reply queue; the kernel spreads peers over the sockets by address hash, so one
+// client's requests always land on the same worker and stay in order
+typedef struct { int sock; pthread_t th; } Worker;
+
+static void* worker_loop(void *arg){
+    int sock=((Worker*)arg)->sock;
+    static __thread char rbuf[RECV_BATCH][BUFSZ]; struct mmsghdr rm[RECV_BATCH]; struct iovec riov[RECV_BATCH]; struct sockaddr_in rsrc[RECV_BATCH];
+    for(;;){
+        wal_commit(); reply_flush(sock); wal_maybe_snapshot();
+        for(int i=0;i<RECV_BATCH;i++){
+            riov[i].iov_base=rbuf[i]; riov[i].iov_len=BUFSZ-1;
+            memset(&rm[i],0,sizeof(rm[i])); rm[i].msg_hdr.msg_name=&rsrc[i]; rm[i].msg_hdr.msg_namelen=sizeof(rsrc[i]);
+            rm[i].msg_hdr.msg_iov=&riov[i]; rm[i].msg_hdr.msg_iovlen=1;
         }
+        int got=recvmmsg(sock,rm,RECV_BATCH,MSG_WAITFORONE,NULL);
+        if(got<0){ perror("recvmmsg"); continue; }
+        for(int mi=0;mi<got;mi++){
+            char *buf=rbuf[mi]; buf[rm[mi].msg_len]='\0'; trim(buf);
+            // heartbeats arrive every second from every disk: not traced
+            if(log_level>=LOG_TRACE&&strncmp(buf,"heartbeat ",10)){ char ip[INET_ADDRSTRLEN]; inet_ntop(AF_INET,&rsrc[mi].sin_addr,ip,sizeof(ip)); log_printf("%s:%u | %s",ip,ntohs(rsrc[mi].sin_port),buf); }
+            Req r; r.sock=sock; r.src=(const struct sockaddr*)&rsrc[mi]; r.slen=rm[mi].msg_hdr.msg_namelen;
+            double t0=now_sec();
+            int ci=dispatch_parse(buf,&r);
+            if(ci<0){ REPLY(&r,"FAILURE"); if(r.id) REPLY(&r,"DONE|lines=1"); mx_add(&unknown_mx,now_sec()-t0,rm[mi].msg_len,1); continue; }
+            if(cmds[ci].lock==REG_W) pthread_rwlock_wrlock(&g_reg);
+            else if(cmds[ci].lock==REG_R) pthread_rwlock_rdlock(&g_reg);
+            cmds[ci].fn(&r);
+            if(cmds[ci].lock!=REG_NONE) pthread_rwlock_unlock(&g_reg);
+            mx_add(&cmd_mx[ci],now_sec()-t0,rm[mi].msg_len,r.failed);
+            if(r.id){ int n=r.nreply; REPLY(&r,"DONE|lines=%d",n); }
+        }
+    }
+    return NULL;
+}
+
+static int bind_port(int port, int reuseport){
+    int sock=socket(AF_INET,SOCK_DGRAM,0); if(sock<0){ perror("socket"); return -1; }
+    int yes=1; setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
+    if(reuseport) setsockopt(sock,SOL_SOCKET,SO_REUSEPORT,&yes,sizeof(yes));
+    struct sockaddr_in addr; memset(&addr,0,sizeof(addr));
+    addr.sin_family=AF_INET; addr.sin_addr.s_addr=htonl(INADDR_ANY); addr.sin_port=htons((uint16_t)port);
+    if(bind(sock,(struct sockaddr*)&addr,sizeof(addr))<0){ perror("bind"); close(sock); return -1; }
+    return sock;
+}
+
+int main(int argc, char **argv){
+    nobuf();
+    if(argc==3&&strcmp(argv[1],"--bench-parse")==0) return bench_parse(argv[2]);
+    if(argc<2){ fprintf(stderr,"usage: manager <manager_listen_port> [--workers=N] [--wal=<dir> [--fsync=batch|off|<ms>] [--snap-every=<records>]] [--lease=<sec>] [--metrics=<file> [--metrics-every=<sec>]] [--quiet] [--log-level=error|info|trace]\n"); return 1; }
+    int port=atoi(argv[1]); if(port<=0||port>65535){ fprintf(stderr,"invalid port: %s\n",argv[1]); return 1; }
+    int nworkers=1; const char *wal_dir=NULL;
+    for(int i=2;i<argc;i++){
+        if(!strcmp(argv[i],"--quiet")) log_level=LOG_INFO;
+        else if(!strcmp(argv[i],"--log-level=error")) log_level=LOG_ERR;
+        else if(!strcmp(argv[i],"--log-level=info")) log_level=LOG_INFO;
+        else if(!strcmp(argv[i],"--log-level=trace")) log_level=LOG_TRACE;
+        else if(!strncmp(argv[i],"--workers=",10)) nworkers=atoi(argv[i]+10);
+        else if(!strncmp(argv[i],"--wal=",6)) wal_dir=argv[i]+6;
+        else if(!strcmp(argv[i],"--fsync=batch")) wal.sync_ms=0;
+        else if(!strcmp(argv[i],"--fsync=off")) wal.sync_ms=-1;
+        else if(!strncmp(argv[i],"--fsync=",8)&&atoi(argv[i]+8)>0) wal.sync_ms=atoi(argv[i]+8);
+        else if(!strncmp(argv[i],"--snap-every=",13)&&atol(argv[i]+13)>0) wal.snap_every=atol(argv[i]+13);
+        else if(!strncmp(argv[i],"--lease=",8)&&atof(argv[i]+8)>0) g_lease_sec=atof(argv[i]+8);
+        else if(!strncmp(argv[i],"--metrics=",10)&&argv[i][10]) metrics_path=argv[i]+10;
+        else if(!strncmp(argv[i],"--metrics-every=",16)&&atoi(argv[i]+16)>0) metrics_every=atoi(argv[i]+16);
+        else{ fprintf(stderr,"unknown option: %s\n",argv[i]); return 1; }
+    }
+    if(nworkers<1) nworkers=1;
+    if(nworkers>64) nworkers=64;
+    cmd_init(); log_start(); g_started=now_sec();
+    if(metrics_path){ pthread_t mt; if(pthread_create(&mt,NULL,metrics_dumper,NULL)!=0){ perror("pthread_create"); return 1; } pthread_detach(mt); }
+    if(wal_dir&&wal_open(wal_dir)<0) return 1;
 
-        send_line(sock,(struct sockaddr*)&src,slen,"FAILURE");
+    // a plain bind first, so a manager already on the port is an error rather than a silent
+    // SO_REUSEPORT sibling
+    int probe=bind_port(port,0); if(probe<0) return 1;
+    if(nworkers==1){ Worker w={probe,0}; worker_loop(&w); return 0; }
+    close(probe);
+    Worker *ws=calloc((size_t)nworkers,sizeof(Worker)); if(!ws){ perror("calloc"); return 1; }
+    for(int i=0;i<nworkers;i++){
+        if((ws[i].sock=bind_port(port,1))<0) return 1;
+        if(pthread_create(&ws[i].th,NULL,worker_loop,&ws[i])!=0){ perror("pthread_create"); return 1; }
     }
+    LOGF(LOG_INFO,"manager: %d workers on port %d",nworkers,port);
+    for(int i=0;i<nworkers;i++) pthread_join(ws[i].th,NULL);
     return 0;
 }
-
@@ -0,0 +1,217 @@
+// proto.h — binary data-plane framing shared by disk.c and user.c (plus the CRC32C and
+// metrics helpers, which manager.c uses too)
+// A binary frame starts with BP_MAGIC, which can never start a text frame ("WRITE|",
+// "READ|", "FAIL|", "DATA|"), so a disk serves both on the same c-port by peeking at
+// byte 0. All multi-byte fields are little-endian.
+//
+//   WRITE: BinHdr + dss[dss_len] + file[file_len] + payload[len]  -> ACK (status: BP_E_CSUM
+//          payload damaged in transit, BP_E_BAD not a valid write, BP_E_FULL no room left)
+//   READ:  BinHdr + dss[dss_len] + file[file_len]  (len = max bytes wanted, 0 = as much as fits)
+//          -> DATA: BinHdr (no names) + payload[len], or DATA with status BP_E_NOENT, or
+//             BP_E_CSUM when the stored block no longer matches the checksum it was sealed with
+//   HELLO: BinHdr -> HELLO with version = highest protocol the disk speaks
+// seq is an opaque client tag echoed in every reply. With BP_F_CSUM set, csum is the
+// CRC32C of the payload: the disk checks it on WRITE and fills it in on DATA.
+// With BP_F_SACK set on a WRITE the sender takes selective acks: the disk may answer several
+// such WRITEs from one peer with a single ACK whose payload is a list of further u32 seqs,
+// all acknowledged with the header's status (only BP_OK acks are merged).
+//
+// Reliability is the sender's job: every WRITE/READ stays outstanding until its ACK/DATA,
+// and is resent after the peer's RTO. BpFlow below is the per-peer sender state -- RTT
+// estimate and RTO (RFC 6298, Karn's rule), an AIMD congestion window (slow start, +1 per
+// window of acks, halved at most once per RTT on a timeout) and the counters behind it.
+
+#ifndef DSS_PROTO_H
+#define DSS_PROTO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <stdatomic.h>
+
+#define BP_MAGIC   0xB5
+#define BP_VERSION 1
+enum { BP_WRITE=1, BP_READ=2, BP_DATA=3, BP_ACK=4, BP_HELLO=5 };
+enum { BP_OK=0, BP_E_NOENT=1, BP_E_CSUM=2, BP_E_FULL=3, BP_E_BAD=4 };
+#define BP_F_CSUM 1u
+#define BP_F_SACK 2u
+
+typedef struct __attribute__((packed)) {
+    uint8_t  magic, version, op, flags;
+    uint8_t  dss_len, file_len; uint16_t status;
+    uint32_t seq;
+    int64_t  stripe, block;
+    uint32_t off, len, total, csum;
+} BinHdr;
+_Static_assert(sizeof(BinHdr)==44,"BinHdr wire size");
+
+// host <-> wire in place; a no-op on little-endian hosts
+static inline void bp_swap(BinHdr *h){
+    h->status=htole16(h->status); h->seq=htole32(h->seq);
+    h->stripe=(int64_t)htole64((uint64_t)h->stripe); h->block=(int64_t)htole64((uint64_t)h->block);
+    h->off=htole32(h->off); h->len=htole32(h->len); h->total=htole32(h->total); h->csum=htole32(h->csum);
+}
+static inline void bp_init(BinHdr *h, int op){ memset(h,0,sizeof(*h)); h->magic=BP_MAGIC; h->version=BP_VERSION; h->op=(uint8_t)op; }
+
+// the seqs an ACK datagram acknowledges (header seq first), at most max of them
+static inline int bp_ack_seqs(const BinHdr *h, const unsigned char *dgram, size_t len, uint32_t *out, int max){
+    int k=0; if(max>0) out[k++]=h->seq;
+    if(!(h->flags&BP_F_SACK)) return k;
+    for(size_t o=sizeof(BinHdr);o+4<=len&&k<max;o+=4){ uint32_t v; memcpy(&v,dgram+o,4); out[k++]=le32toh(v); }
+    return k;
+}
+// fold one more acked seq into an ACK frame of *len bytes (cap bytes of room); 0 when full
+static inline int bp_sack_add(unsigned char *frame, size_t *len, size_t cap, uint32_t seq){
+    if(*len+4>cap) return 0;
+    seq=htole32(seq); memcpy(frame+*len,&seq,4); *len+=4; return 1;
+}
+
+#define BP_RTO_INIT 0.2
+#define BP_RTO_MIN  0.05
+#define BP_RTO_MAX  2.0
+typedef struct {
+    double srtt, rttvar, rto, cwnd, ssthresh, cwnd_max, last_cut;
+    long long sent, acked, retx, timeouts, rtt_n; double rtt_sum, rtt_min, rtt_max;
+} BpFlow;
+static inline void bp_flow_init(BpFlow *f, double cwnd_max){
+    memset(f,0,sizeof(*f)); f->rto=BP_RTO_INIT; f->cwnd=cwnd_max<4?cwnd_max:4; f->ssthresh=f->cwnd_max=cwnd_max;
+}
+static inline int bp_flow_window(const BpFlow *f){ int w=(int)f->cwnd; return w<1?1:w; }
+// a frame left the window acknowledged; rtt<0 when it had been resent (no sample, Karn)
+static inline void bp_flow_ack(BpFlow *f, double rtt){
+    f->acked++;
+    if(rtt>=0){
+        if(!f->rtt_n){ f->srtt=rtt; f->rttvar=rtt/2; f->rtt_min=f->rtt_max=rtt; }
+        else{ double e=rtt-f->srtt; f->rttvar=0.75*f->rttvar+0.25*(e<0?-e:e); f->srtt+=0.125*e; }
+        f->rtt_n++; f->rtt_sum+=rtt; if(rtt<f->rtt_min) f->rtt_min=rtt; if(rtt>f->rtt_max) f->rtt_max=rtt;
+        f->rto=f->srtt+4*f->rttvar; if(f->rto<BP_RTO_MIN) f->rto=BP_RTO_MIN; if(f->rto>BP_RTO_MAX) f->rto=BP_RTO_MAX;
+    }
+    f->cwnd+=f->cwnd<f->ssthresh?1.0:1.0/f->cwnd;
+    if(f->cwnd>f->cwnd_max) f->cwnd=f->cwnd_max;
+}
+// a frame's RTO ran out: resend it; the first timeout of a round halves cwnd and backs off RTO
+static inline void bp_flow_timeout(BpFlow *f, double now){
+    f->retx++;
+    if(now-f->last_cut<f->rto) return;
+    f->timeouts++; f->last_cut=now;
+    f->ssthresh=f->cwnd/2<2?2:f->cwnd/2; f->cwnd=f->ssthresh;
+    f->rto*=2; if(f->rto>BP_RTO_MAX) f->rto=BP_RTO_MAX;
+}
+
+// CRC32C (Castagnoli), reflected. crc32c() runs the SSE4.2 crc32 instruction (8 bytes per
+// step) when the CPU has it, else the byte-wise table; DSS_CRC=table forces the table
+// (table: polynomial 0x82f63b78, entry i = i run through 8 shift/xor steps)
+static const uint32_t crc32c_tbl[256]={
+    0x00000000u,0xf26b8303u,0xe13b70f7u,0x1350f3f4u,0xc79a971fu,0x35f1141cu,0x26a1e7e8u,0xd4ca64ebu,
+    0x8ad958cfu,0x78b2dbccu,0x6be22838u,0x9989ab3bu,0x4d43cfd0u,0xbf284cd3u,0xac78bf27u,0x5e133c24u,
+    0x105ec76fu,0xe235446cu,0xf165b798u,0x030e349bu,0xd7c45070u,0x25afd373u,0x36ff2087u,0xc494a384u,
+    0x9a879fa0u,0x68ec1ca3u,0x7bbcef57u,0x89d76c54u,0x5d1d08bfu,0xaf768bbcu,0xbc267848u,0x4e4dfb4bu,
+    0x20bd8edeu,0xd2d60dddu,0xc186fe29u,0x33ed7d2au,0xe72719c1u,0x154c9ac2u,0x061c6936u,0xf477ea35u,
+    0xaa64d611u,0x580f5512u,0x4b5fa6e6u,0xb93425e5u,0x6dfe410eu,0x9f95c20du,0x8cc531f9u,0x7eaeb2fau,
+    0x30e349b1u,0xc288cab2u,0xd1d83946u,0x23b3ba45u,0xf779deaeu,0x05125dadu,0x1642ae59u,0xe4292d5au,
+    0xba3a117eu,0x4851927du,0x5b016189u,0xa96ae28au,0x7da08661u,0x8fcb0562u,0x9c9bf696u,0x6ef07595u,
+    0x417b1dbcu,0xb3109ebfu,0xa0406d4bu,0x522bee48u,0x86e18aa3u,0x748a09a0u,0x67dafa54u,0x95b17957u,
+    0xcba24573u,0x39c9c670u,0x2a993584u,0xd8f2b687u,0x0c38d26cu,0xfe53516fu,0xed03a29bu,0x1f682198u,
+    0x5125dad3u,0xa34e59d0u,0xb01eaa24u,0x42752927u,0x96bf4dccu,0x64d4cecfu,0x77843d3bu,0x85efbe38u,
+    0xdbfc821cu,0x2997011fu,0x3ac7f2ebu,0xc8ac71e8u,0x1c661503u,0xee0d9600u,0xfd5d65f4u,0x0f36e6f7u,
+    0x61c69362u,0x93ad1061u,0x80fde395u,0x72966096u,0xa65c047du,0x5437877eu,0x4767748au,0xb50cf789u,
+    0xeb1fcbadu,0x197448aeu,0x0a24bb5au,0xf84f3859u,0x2c855cb2u,0xdeeedfb1u,0xcdbe2c45u,0x3fd5af46u,
+    0x7198540du,0x83f3d70eu,0x90a324fau,0x62c8a7f9u,0xb602c312u,0x44694011u,0x5739b3e5u,0xa55230e6u,
+    0xfb410cc2u,0x092a8fc1u,0x1a7a7c35u,0xe811ff36u,0x3cdb9bddu,0xceb018deu,0xdde0eb2au,0x2f8b6829u,
+    0x82f63b78u,0x709db87bu,0x63cd4b8fu,0x91a6c88cu,0x456cac67u,0xb7072f64u,0xa457dc90u,0x563c5f93u,
+    0x082f63b7u,0xfa44e0b4u,0xe9141340u,0x1b7f9043u,0xcfb5f4a8u,0x3dde77abu,0x2e8e845fu,0xdce5075cu,
+    0x92a8fc17u,0x60c37f14u,0x73938ce0u,0x81f80fe3u,0x55326b08u,0xa759e80bu,0xb4091bffu,0x466298fcu,
+    0x1871a4d8u,0xea1a27dbu,0xf94ad42fu,0x0b21572cu,0xdfeb33c7u,0x2d80b0c4u,0x3ed04330u,0xccbbc033u,
+    0xa24bb5a6u,0x502036a5u,0x4370c551u,0xb11b4652u,0x65d122b9u,0x97baa1bau,0x84ea524eu,0x7681d14du,
+    0x2892ed69u,0xdaf96e6au,0xc9a99d9eu,0x3bc21e9du,0xef087a76u,0x1d63f975u,0x0e330a81u,0xfc588982u,
+    0xb21572c9u,0x407ef1cau,0x532e023eu,0xa145813du,0x758fe5d6u,0x87e466d5u,0x94b49521u,0x66df1622u,
+    0x38cc2a06u,0xcaa7a905u,0xd9f75af1u,0x2b9cd9f2u,0xff56bd19u,0x0d3d3e1au,0x1e6dcdeeu,0xec064eedu,
+    0xc38d26c4u,0x31e6a5c7u,0x22b65633u,0xd0ddd530u,0x0417b1dbu,0xf67c32d8u,0xe52cc12cu,0x1747422fu,
+    0x49547e0bu,0xbb3ffd08u,0xa86f0efcu,0x5a048dffu,0x8ecee914u,0x7ca56a17u,0x6ff599e3u,0x9d9e1ae0u,
+    0xd3d3e1abu,0x21b862a8u,0x32e8915cu,0xc083125fu,0x144976b4u,0xe622f5b7u,0xf5720643u,0x07198540u,
+    0x590ab964u,0xab613a67u,0xb831c993u,0x4a5a4a90u,0x9e902e7bu,0x6cfbad78u,0x7fab5e8cu,0x8dc0dd8fu,
+    0xe330a81au,0x115b2b19u,0x020bd8edu,0xf0605beeu,0x24aa3f05u,0xd6c1bc06u,0xc5914ff2u,0x37faccf1u,
+    0x69e9f0d5u,0x9b8273d6u,0x88d28022u,0x7ab90321u,0xae7367cau,0x5c18e4c9u,0x4f48173du,0xbd23943eu,
+    0xf36e6f75u,0x0105ec76u,0x12551f82u,0xe03e9c81u,0x34f4f86au,0xc69f7b69u,0xd5cf889du,0x27a40b9eu,
+    0x79b737bau,0x8bdcb4b9u,0x988c474du,0x6ae7c44eu,0xbe2da0a5u,0x4c4623a6u,0x5f16d052u,0xad7d5351u
+};
+static inline uint32_t crc32c_table(uint32_t crc, const void *buf, size_t n){
+    const unsigned char *p=buf; crc=~crc;
+    while(n--) crc=crc32c_tbl[(crc^*p++)&0xff]^(crc>>8);
+    return ~crc;
+}
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+__attribute__((target("sse4.2"))) static inline uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t n){
+    const unsigned char *p=buf; uint64_t c=(uint32_t)~crc;
+    for(;n&&((uintptr_t)p&7);n--) c=_mm_crc32_u8((uint32_t)c,*p++);
+    for(;n>=8;n-=8,p+=8){ uint64_t v; memcpy(&v,p,8); c=_mm_crc32_u64(c,v); }
+    while(n--) c=_mm_crc32_u8((uint32_t)c,*p++);
+    return ~(uint32_t)c;
+}
+#endif
+static inline int crc32c_hw(void){
+    static _Atomic int hw=-1; int v=atomic_load_explicit(&hw,memory_order_relaxed);
+    if(v<0){
+        const char *e=getenv("DSS_CRC"); v=0;
+#if defined(__x86_64__)
+        v=__builtin_cpu_supports("sse4.2")&&!(e&&!strcmp(e,"table"));
+#endif
+        (void)e; atomic_store_explicit(&hw,v,memory_order_relaxed);
+    }
+    return v;
+}
+static inline const char* crc32c_impl(void){ return crc32c_hw()?"sse4.2":"table"; }
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t n){
+#if defined(__x86_64__)
+    if(crc32c_hw()) return crc32c_sse42(crc,buf,n);
+#endif
+    return crc32c_table(crc,buf,n);
+}
+
+// metrics: one counter set + latency histogram per operation, bumped with relaxed atomics
+// from any thread. bucket b counts latencies under 2^b us; the last one takes the rest (~8 s+).
+// quantiles come back as the upper bound of their bucket, so they are within 2x
+#define MX_BUCKETS 24
+typedef struct { _Atomic unsigned long long n, err, bytes, sum_ns, b[MX_BUCKETS]; } Metric;
+static inline void mx_add(Metric *m, double secs, unsigned long long bytes, int err){
+    unsigned long long ns=secs>0?(unsigned long long)(secs*1e9):0, us=ns/1000; int b=0;
+    while(b<MX_BUCKETS-1&&(1ull<<b)<=us) b++;
+    atomic_fetch_add_explicit(&m->n,1,memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->b[b],1,memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->sum_ns,ns,memory_order_relaxed);
+    if(bytes) atomic_fetch_add_explicit(&m->bytes,bytes,memory_order_relaxed);
+    if(err) atomic_fetch_add_explicit(&m->err,1,memory_order_relaxed);
+}
+static inline unsigned long long mx_quantile(const Metric *m, double q){
+    unsigned long long n=0, c[MX_BUCKETS];
+    for(int b=0;b<MX_BUCKETS;b++) n+=c[b]=atomic_load_explicit(&m->b[b],memory_order_relaxed);
+    unsigned long long want=(unsigned long long)(q*(double)n), cum=0;
+    for(int b=0;b<MX_BUCKETS;b++) if((cum+=c[b])>want) return 1ull<<b;
+    return 0;
+}
+// "n=..|err=..|bytes=..|avg_us=..|p50_us=..|p99_us=..|p999_us=.." for a STAT| reply line
+static inline int mx_line(char *out, size_t cap, const Metric *m){
+    unsigned long long n=atomic_load(&m->n);
+    return snprintf(out,cap,"n=%llu|err=%llu|bytes=%llu|avg_us=%.1f|p50_us=%llu|p99_us=%llu|p999_us=%llu",
+        n,atomic_load(&m->err),atomic_load(&m->bytes),n?atomic_load(&m->sum_ns)/1e3/(double)n:0.0,mx_quantile(m,0.5),mx_quantile(m,0.99),mx_quantile(m,0.999));
+}
+// one Prometheus histogram (name_bucket/_sum/_count) for the label set labels ("k=\"v\",...")
+static inline void mx_prom(FILE *f, const char *name, const char *labels, const Metric *m){
+    unsigned long long cum=0;
+    for(int b=0;b<MX_BUCKETS-1;b++){ cum+=atomic_load(&m->b[b]); fprintf(f,"%s_bucket{%s,le=\"%g\"} %llu\n",name,labels,(double)(1ull<<b)/1e6,cum); }
+    cum+=atomic_load(&m->b[MX_BUCKETS-1]);
+    fprintf(f,"%s_bucket{%s,le=\"+Inf\"} %llu\n%s_sum{%s} %.9f\n%s_count{%s} %llu\n",name,labels,cum,name,labels,atomic_load(&m->sum_ns)/1e9,name,labels,cum);
+}
+// emit(f) into path through a temp file and rename, so a scraper never reads half a dump
+static inline int mx_dump(const char *path, void (*emit)(FILE*)){
+    char tmp[4096]; snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    FILE *f=fopen(tmp,"w"); if(!f) return -1;
+    emit(f);
+    if(fclose(f)!=0||rename(tmp,path)!=0){ remove(tmp); return -1; }
+    return 0;
+}
+
+#endif
@@ -2,8 +2,26 @@
 // Build:   gcc -O2 -Wall -Wextra -o user user.c
 // Run:     ./user <user-name> <manager-ip> <manager-port> <m-port> <c-port>
 // threads: none (single-thread read replies and sends commands to manager)
-// I/O: read w short SO_RCVTIMEO to drain bursts from manager reply
+// I/O: manager requests carry a "#<id>" tag and replies end with a tagged DONE line, so a
+//      reply is complete when that arrives; plain commands are pipelined (PIPE_MAX in flight)
+// data plane: "copy file=<local-path> dss=<dss> [window=N]" asks the manager for the disk map,
+//             then stripes the file over the disks from the c-port socket (binary frames, proto.h).
+//             the manager grants a write lease on the file for the upload; it is renewed every
+//             third of its ttl while blocks stream and given back by copy-complete/copy-abort
+//             "read file=<name> dss=<dss> [out=<path>|-] [depth=N]" fetches it back in parallel
+//             "disk-failure dss=<dss> [disk=<name>] [rate=<MB/s>] [depth=N]" wipes one disk and
+//             rebuilds it from the survivors, reporting progress to the manager
+// transport:  WRITE/READ frames are acked (selectively, BP_F_SACK) and resent after an adaptive
+//             RTO; each disk gets an AIMD congestion window capped by window=/depth=.
+//             "netstat" prints per-disk cwnd, RTT, RTO and retransmit counters
+// scripting:  "sync" waits for every pipelined reply, then prints SYNC (./bench marks op ends with it)
+// listing:    "ls [dss=<dss>] [owner=<user>] [prefix=<p>] [limit=N]" pages through the manager's
+//             listing with its cursor until END (filters are applied by the manager)
+// parity:     RAID-5 with rotating parity (n-1 data blocks + 1 parity block per stripe); a read
+//             with one disk missing rebuilds its blocks from the others. XOR kernel is picked at
+//             startup (scalar/sse2/avx2, DSS_XOR=<name> forces one); ./user --bench-xor reports GB/s
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,19 +32,783 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "proto.h"
+#if defined(__x86_64__)||defined(__i386__)
+#include <immintrin.h>
+#endif
 
 static void nobuf(void){ setvbuf(stdout,NULL,_IONBF,0); setvbuf(stderr,NULL,_IONBF,0); }
 
-static void recv_and_print_with_timeout(int sock, int millis){
-    struct timeval tv; tv.tv_sec=millis/1000; tv.tv_usec=(millis%1000)*1000;
-    setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
-    char buf[4096]; ssize_t n=recvfrom(sock,buf,sizeof(buf)-1,0,NULL,NULL);
-    if(n>0){ buf[n]='\0'; fputs(buf,stdout); }
-    tv.tv_sec=0; tv.tv_usec=0; setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+static double now_sec(void){ struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts); return ts.tv_sec+ts.tv_nsec/1e9; }
+
+static const char* kvget(const char *line, const char *key, char *out, size_t outsz){
+    const char *p=line; size_t klen=strlen(key);
+    while((p=strstr(p,key))){
+        if((p==line||isspace((unsigned char)p[-1])||p[-1]=='|')&&p[klen]=='='){
+            p+=klen+1; size_t i=0;
+            while(*p&&!isspace((unsigned char)*p)&&*p!='|'&&i+1<outsz) out[i++]=*p++;
+            out[i]='\0'; return out;
+        }
+        ++p;
+    }
+    return NULL;
+}
+
+// manager requests go out as "#<id> <command>"; every reply line comes back with the same tag
+// and the reply ends with "#<id> DONE|lines=N", so lines are routed to their request as they
+// arrive and a reply is finished (and known complete) the moment its DONE line lands.
+// up to PIPE_MAX requests can be in flight; replies come back in request order
+#define PIPE_MAX 32
+#define REPLY_WAIT_SEC 2.0
+typedef struct { unsigned id; double sent; char *text; size_t len, cap; int lines, done, ok; char cmd[64]; } Pending;
+static Pending pend[PIPE_MAX]; static int npend; static unsigned next_id;
+
+static void pend_add_line(Pending *p, const char *l, size_t n){
+    if(p->len+n+2>p->cap){ p->cap=(p->len+n+2)*2; char *t=realloc(p->text,p->cap); if(!t){ perror("realloc"); exit(1); } p->text=t; }
+    memcpy(p->text+p->len,l,n); p->len+=n; p->text[p->len++]='\n'; p->text[p->len]='\0'; p->lines++;
+}
+// the slot of the new request, or -1 (table full or send failed)
+static int pipe_send(int s, const struct sockaddr_in *mgr, const char *cmd){
+    if(npend==PIPE_MAX) return -1;
+    char buf[1200]; int k=snprintf(buf,sizeof(buf),"#%u %s",++next_id,cmd);
+    if(k<0||(size_t)k>=sizeof(buf)){ fprintf(stderr,"command too long\n"); return -1; }
+    if(sendto(s,buf,(size_t)k,0,(const struct sockaddr*)mgr,sizeof(*mgr))<0){ perror("sendto"); return -1; }
+    Pending *p=&pend[npend]; char *text=p->text; size_t cap=p->cap;
+    memset(p,0,sizeof(*p)); p->text=text; p->cap=cap; p->id=next_id; p->sent=now_sec();
+    if(p->text) p->text[0]='\0';
+    snprintf(p->cmd,sizeof(p->cmd),"%.*s",(int)strcspn(cmd,"\r\n"),cmd);
+    return npend++;
+}
+// route the lines of one datagram to their requests; untagged and stale lines are dropped
+static void pipe_route(char *buf){
+    for(char *l=buf;*l;){
+        char *nl=strchr(l,'\n'); size_t n=nl?(size_t)(nl-l):strlen(l);
+        char *sp; unsigned long id;
+        if(*l=='#'&&(id=strtoul(l+1,&sp,10))&&*sp==' '){
+            for(int i=0;i<npend;i++){
+                Pending *p=&pend[i]; if(p->id!=id||p->done) continue;
+                const char *body=sp+1; size_t bn=n-(size_t)(body-l);
+                if(!strncmp(body,"DONE|lines=",11)){ p->done=1; p->ok=atoi(body+11)==p->lines; }
+                else pend_add_line(p,body,bn);
+                break;
+            }
+        }
+        l=nl?nl+1:l+n;
+    }
+}
+// wait up to ms for a datagram and route it; requests past REPLY_WAIT_SEC end unanswered
+static void pipe_pump(int s, int ms){
+    struct pollfd pfd={s,POLLIN,0};
+    if(poll(&pfd,1,ms)>0){
+        char buf[4096];
+        for(ssize_t n;(n=recv(s,buf,sizeof(buf)-1,MSG_DONTWAIT))>0;){ buf[n]='\0'; pipe_route(buf); }
+    }
+    double t=now_sec();
+    for(int i=0;i<npend;i++) if(!pend[i].done&&t-pend[i].sent>REPLY_WAIT_SEC) pend[i].done=1;
+}
+// print finished replies from the front, in request order
+static void pipe_print(void){
+    int k=0;
+    while(k<npend&&pend[k].done){
+        Pending *p=&pend[k++];
+        if(p->len) fputs(p->text,stdout);
+        if(!p->ok) fprintf(stderr,"%s: %s\n",p->cmd,p->lines?"reply incomplete":"manager did not answer");
+    }
+    if(!k) return;
+    Pending tmp[PIPE_MAX]; memcpy(tmp,pend,(size_t)k*sizeof(Pending)); // keep the text buffers for reuse
+    memmove(pend,pend+k,(size_t)(npend-k)*sizeof(Pending)); memcpy(pend+npend-k,tmp,(size_t)k*sizeof(Pending));
+    npend-=k;
+}
+static void pipe_drain(int s){ while(npend){ pipe_pump(s,100); pipe_print(); } }
+
+// one request, waited for: its reply lines (tags stripped) into out, echoed to stdout when
+// echo is set. -1 when no complete reply came, 0 when it ends in SUCCESS, 1 otherwise
+static int mgr_call(int s, const struct sockaddr_in *mgr, const char *cmd, char *out, size_t outsz, int echo){
+    pipe_drain(s);
+    if(pipe_send(s,mgr,cmd)<0) return -1;
+    while(!pend[0].done) pipe_pump(s,100);
+    Pending *p=&pend[0]; int rc=-1;
+    snprintf(out,outsz,"%s",p->len?p->text:"");
+    if(echo&&p->len) fputs(p->text,stdout);
+    if(!p->ok) fprintf(stderr,"%s: %s\n",p->cmd,p->lines?"reply incomplete":"manager did not answer");
+    else{ const char *last=p->text; for(const char *q=p->text;*q;q++) if(*q=='\n'&&q[1]) last=q+1; rc=strncmp(last,"SUCCESS",7)!=0; }
+    p->done=1; p->ok=1; p->len=0; npend=0; // nothing else was in flight
+    return rc;
+}
+// send one command to the manager and collect its reply lines into out (also echoed to
+// stdout); 0 when the reply ends in SUCCESS
+static int mgr_request(int s, const struct sockaddr_in *mgr, const char *cmd, char *out, size_t outsz){
+    return mgr_call(s,mgr,cmd,out,outsz,1)==0?0:-1;
+}
+
+// DISK|k|name|ip|cport lines of a copy/read reply, plus n and su from its SUCCESS line
+#define DISKS_MAX 64
+typedef struct { char name[64]; struct sockaddr_in addr; } DiskRef;
+typedef struct { int n; int su; DiskRef d[DISKS_MAX]; } DiskMap;
+static int parse_disk_map(char *reply, DiskMap *m){
+    memset(m,0,sizeof(*m)); int seen=0;
+    for(char *save=NULL,*l=strtok_r(reply,"\n",&save); l; l=strtok_r(NULL,"\n",&save)){
+        int k; char name[64],ip[64]; int cport;
+        if(sscanf(l,"DISK|%d|%63[^|]|%63[^|]|%d",&k,name,ip,&cport)==4&&k>=0&&k<DISKS_MAX){
+            snprintf(m->d[k].name,sizeof(m->d[k].name),"%s",name);
+            m->d[k].addr.sin_family=AF_INET; m->d[k].addr.sin_port=htons((uint16_t)cport);
+            if(inet_pton(AF_INET,ip,&m->d[k].addr.sin_addr)!=1) return -1;
+            seen++;
+        }
+        if(!strncmp(l,"SUCCESS|",8)){ char t[32]; if(kvget(l,"n",t,sizeof(t))) m->n=atoi(t); if(kvget(l,"su",t,sizeof(t))) m->su=atoi(t); }
+    }
+    return (m->n>0&&m->n<=DISKS_MAX&&seen==m->n&&m->su>0)?0:-1;
+}
+
+// XOR kernels for parity: scalar, SSE2 and AVX2, picked once at startup from what the CPU
+// supports (DSS_XOR=scalar|sse2|avx2 forces one). xor_into(dst,src,n): dst ^= src.
+typedef void (*XorFn)(unsigned char*, const unsigned char*, size_t);
+static void xor_scalar(unsigned char *dst, const unsigned char *src, size_t n){
+    size_t i=0;
+    for(;i+8<=n;i+=8){ uint64_t a,b; memcpy(&a,dst+i,8); memcpy(&b,src+i,8); a^=b; memcpy(dst+i,&a,8); }
+    for(;i<n;i++) dst[i]^=src[i];
+}
+#if defined(__x86_64__)||defined(__i386__)
+__attribute__((target("sse2"))) static void xor_sse2(unsigned char *dst, const unsigned char *src, size_t n){
+    size_t i=0;
+    for(;i+32<=n;i+=32){
+        __m128i a0=_mm_loadu_si128((const __m128i*)(dst+i)), a1=_mm_loadu_si128((const __m128i*)(dst+i+16));
+        a0=_mm_xor_si128(a0,_mm_loadu_si128((const __m128i*)(src+i))); a1=_mm_xor_si128(a1,_mm_loadu_si128((const __m128i*)(src+i+16)));
+        _mm_storeu_si128((__m128i*)(dst+i),a0); _mm_storeu_si128((__m128i*)(dst+i+16),a1);
+    }
+    xor_scalar(dst+i,src+i,n-i);
+}
+__attribute__((target("avx2"))) static void xor_avx2(unsigned char *dst, const unsigned char *src, size_t n){
+    size_t i=0;
+    for(;i+64<=n;i+=64){
+        __m256i a0=_mm256_loadu_si256((const __m256i*)(dst+i)), a1=_mm256_loadu_si256((const __m256i*)(dst+i+32));
+        a0=_mm256_xor_si256(a0,_mm256_loadu_si256((const __m256i*)(src+i))); a1=_mm256_xor_si256(a1,_mm256_loadu_si256((const __m256i*)(src+i+32)));
+        _mm256_storeu_si256((__m256i*)(dst+i),a0); _mm256_storeu_si256((__m256i*)(dst+i+32),a1);
+    }
+    xor_scalar(dst+i,src+i,n-i);
+}
+static int has_sse2(void){ return __builtin_cpu_supports("sse2"); }
+static int has_avx2(void){ return __builtin_cpu_supports("avx2"); }
+#endif
+static int has_any(void){ return 1; }
+static const struct { const char *name; XorFn fn; int (*ok)(void); } xor_kernels[]={
+    {"scalar",xor_scalar,has_any},
+#if defined(__x86_64__)||defined(__i386__)
+    {"sse2",xor_sse2,has_sse2},
+    {"avx2",xor_avx2,has_avx2},
+#endif
+};
+#define XOR_KERNELS ((int)(sizeof(xor_kernels)/sizeof(xor_kernels[0])))
+static XorFn xor_into=xor_scalar; static const char *xor_name="scalar";
+static void xor_select(void){
+    const char *want=getenv("DSS_XOR");
+    for(int i=0;i<XOR_KERNELS;i++){
+        if(!xor_kernels[i].ok()) continue;
+        if(want&&strcmp(want,xor_kernels[i].name)!=0) continue;
+        xor_into=xor_kernels[i].fn; xor_name=xor_kernels[i].name;
+    }
+}
+
+// ./user --bench-xor: GB/s of every kernel the CPU supports, in-cache and streaming
+static int bench_xor(void){
+    static const size_t sizes[]={32768,1<<20,64<<20};
+    printf("%-8s %12s %12s %12s\n","kernel","32K GB/s","1M GB/s","64M GB/s");
+    for(int k=0;k<XOR_KERNELS;k++){
+        if(!xor_kernels[k].ok()) continue;
+        printf("%-8s",xor_kernels[k].name);
+        for(size_t si=0;si<sizeof(sizes)/sizeof(sizes[0]);si++){
+            size_t n=sizes[si]; unsigned char *a=malloc(n), *b=malloc(n); if(!a||!b) return 1;
+            memset(a,0x5a,n); memset(b,0xa5,n);
+            double t0=now_sec(), el; size_t bytes=0;
+            do{ for(int r=0;r<16;r++){ xor_kernels[k].fn(a,b,n); bytes+=n; } el=now_sec()-t0; }while(el<0.25);
+            printf(" %12.2f",bytes/el/1e9);
+            free(a); free(b);
+        }
+        printf("\n");
+    }
+    printf("selected: %s\n",xor_name);
+    return 0;
+}
+
+// RAID-5 layout (left-symmetric): a stripe holds n-1 data blocks of su bytes plus one
+// parity block. stripe s keeps parity on disk par_disk(s) and its data block j on disk
+// (par_disk(s)+1+j)%n; every block is stored under key (stripe=s, block=<disk position>).
+// blocks travel in fragments of at most FRAG bytes; the parity of fragment `piece` of a
+// stripe is the XOR of that piece of each data block (missing/short blocks count as zero).
+#define FRAG 32768
+#define DGRAM_RX 65536
+#define RTO_SEC 0.2
+#define RETRY_MAX 20
+#define GIVEUP_SEC 5.0
+typedef struct { int n; size_t su, fs; long long fsize, nblk, nstripe, fpb, nfrag; } Geo;
+static void geo_init(Geo *g, int n, size_t su, long long fsize){
+    g->n=n; g->su=su; g->fs=su<FRAG?su:FRAG; g->fsize=fsize; g->fpb=(long long)((su+g->fs-1)/g->fs);
+    g->nblk=(fsize+(long long)su-1)/(long long)su; g->nstripe=(g->nblk+n-2)/(n-1);
+    g->nfrag=g->nblk?(g->nblk-1)*g->fpb+(long long)((fsize-(g->nblk-1)*(long long)su+g->fs-1)/g->fs):0;
+}
+static int par_disk(const Geo *g, long long s){ return (int)(g->n-1-s%g->n); }
+static int data_disk(const Geo *g, long long s, int j){ return (par_disk(g,s)+1+j)%g->n; }
+static int data_index(const Geo *g, long long s, int d){ return (d-par_disk(g,s)-1+2*g->n)%g->n; } // n-1 = parity
+static size_t blk_len(const Geo *g, long long b){ if(b>=g->nblk) return 0; long long r=g->fsize-b*(long long)g->su; return r<(long long)g->su?(size_t)r:g->su; }
+static size_t frag_len(const Geo *g, long long b, long long piece){ size_t bl=blk_len(g,b), off=(size_t)piece*g->fs; return off>=bl?0:(bl-off<g->fs?bl-off:g->fs); }
+
+// one binary frame per slot: header + dss + file (+ payload for WRITE)
+static unsigned char* frame_start(unsigned char *frame, BinHdr *h, int op, const char *dss, const char *fname){
+    size_t dl=strlen(dss), fl=strlen(fname);
+    bp_init(h,op); h->flags=BP_F_CSUM; h->dss_len=(uint8_t)dl; h->file_len=(uint8_t)fl;
+    memcpy(frame+sizeof(*h),dss,dl); memcpy(frame+sizeof(*h)+dl,fname,fl);
+    return frame+sizeof(*h)+dl+fl;
+}
+static size_t frame_seal(unsigned char *frame, BinHdr *h, const unsigned char *payload, size_t len){
+    if(h->op==BP_WRITE) h->csum=crc32c(0,payload,len);
+    size_t total=sizeof(*h)+h->dss_len+h->file_len+(h->op==BP_WRITE?len:0);
+    bp_swap(h); memcpy(frame,h,sizeof(*h)); bp_swap(h);
+    return total;
+}
+static void mm_push(struct mmsghdr *mm, struct iovec *iov, int *nq, void *buf, size_t len, const struct sockaddr_in *to){
+    iov[*nq].iov_base=buf; iov[*nq].iov_len=len;
+    memset(&mm[*nq],0,sizeof(mm[*nq])); mm[*nq].msg_hdr.msg_name=(void*)to; mm[*nq].msg_hdr.msg_namelen=sizeof(*to);
+    mm[*nq].msg_hdr.msg_iov=&iov[*nq]; mm[*nq].msg_hdr.msg_iovlen=1; (*nq)++;
+}
+
+// per-disk transport state (BpFlow, proto.h): RTT/RTO, congestion window and counters. kept
+// for the life of the client so a disk's window and RTT carry over between operations;
+// "netstat" prints them
+#define PEERS_MAX 256
+static struct { char name[64]; BpFlow fl; } peers[PEERS_MAX]; static int npeers;
+static BpFlow* peer_flow(const char *name, int cap){
+    int i=0; while(i<npeers&&strcmp(peers[i].name,name)!=0) i++;
+    if(i==npeers){ if(npeers<PEERS_MAX) npeers++; else i=PEERS_MAX-1; snprintf(peers[i].name,sizeof(peers[i].name),"%s",name); bp_flow_init(&peers[i].fl,cap); }
+    BpFlow *f=&peers[i].fl; f->cwnd_max=cap; if(f->cwnd>cap) f->cwnd=cap;
+    return f;
+}
+static void do_netstat(void){
+    for(int i=0;i<npeers;i++){
+        const BpFlow *f=&peers[i].fl;
+        printf("NET|disk=%s|cwnd=%.1f|ssthresh=%.1f|srtt_ms=%.3f|rto_ms=%.1f|sent=%lld|acked=%lld|retx=%lld|timeouts=%lld|rtt_ms=%.3f/%.3f/%.3f\n",
+               peers[i].name,f->cwnd,f->ssthresh,f->srtt*1e3,f->rto*1e3,f->sent,f->acked,f->retx,f->timeouts,f->rtt_min*1e3,f->rtt_n?f->rtt_sum/f->rtt_n*1e3:0.0,f->rtt_max*1e3);
+    }
+    printf("%s\n",npeers?"SUCCESS":"FAILURE no transfers yet");
+}
+
+// copy engine: works in stripe-fragments (stripe s, piece). each one reads the n-1 data
+// fragments with pread(), XORs them into the parity fragment and puts n WRITEs in flight.
+// every disk keeps up to its congestion window (at most `window`) of fragments outstanding;
+// a fragment leaves the window when its (selective) ACK arrives and is resent after the
+// disk's RTO without one. `renew` (fire-and-forget, its reply is dropped) goes to the manager
+// every `every` seconds to keep the file's write lease.
+typedef struct { int s; const struct sockaddr_in *mgr; const char *cmd; double every, last; } Renew;
+typedef struct { int busy; uint32_t seq; int tries; double sent, first; size_t len; unsigned char frame[sizeof(BinHdr)+128+FRAG]; } Slot;
+
+static Slot* free_slot(Slot *slots, int d, int window){ for(int i=0;i<window;i++) if(!slots[d*window+i].busy) return &slots[d*window+i]; return NULL; }
+
+static int copy_engine(int cs, int fd, const Geo *g, const char *dss, const char *fname, const DiskMap *m, int window, Renew *renew, long long *retx){
+    int n=g->n; Slot *slots=calloc((size_t)n*window,sizeof(Slot)); int *inflight=calloc((size_t)n,sizeof(int));
+    if(!slots||!inflight){ free(slots); free(inflight); return -1; }
+    BpFlow *fl[DISKS_MAX]; for(int d=0;d<n;d++) fl[d]=peer_flow(m->d[d].name,window);
+    uint32_t gen=0; int rc=0; long long s=0, piece=0;
+    struct mmsghdr mm[64]; struct iovec iov[64];
+    for(;;){
+        int nq=0;
+        while(s<g->nstripe&&nq+n<=64){
+            int room=1; for(int d=0;d<n;d++) if(inflight[d]>=bp_flow_window(fl[d])) room=0;
+            if(!room) break;
+            long long b0=s*(n-1); int pd=par_disk(g,s); BinHdr h;
+            Slot *ps=free_slot(slots,pd,window);
+            unsigned char *par=frame_start(ps->frame,&h,BP_WRITE,dss,fname); size_t plen=frag_len(g,b0,piece); h.flags|=BP_F_SACK;
+            memset(par,0,plen);
+            for(int j=0;j<n-1;j++){
+                long long b=b0+j; size_t len=frag_len(g,b,piece); if(!len) continue;
+                int d=data_disk(g,s,j); Slot *sl=free_slot(slots,d,window); BinHdr dh;
+                unsigned char *p=frame_start(sl->frame,&dh,BP_WRITE,dss,fname); dh.flags|=BP_F_SACK;
+                if(pread(fd,p,len,(off_t)(b*(long long)g->su+piece*(long long)g->fs))!=(ssize_t)len){ perror("pread"); rc=-1; goto out; }
+                xor_into(par,p,len);
+                dh.seq=sl->seq=(++gen<<12)|(uint32_t)(sl-slots); dh.stripe=s; dh.block=d; dh.off=(uint32_t)(piece*(long long)g->fs); dh.len=(uint32_t)len; dh.total=(uint32_t)blk_len(g,b);
+                sl->len=frame_seal(sl->frame,&dh,p,len); sl->busy=1; sl->tries=0; sl->sent=sl->first=now_sec(); inflight[d]++; fl[d]->sent++;
+                mm_push(mm,iov,&nq,sl->frame,sl->len,&m->d[d].addr);
+            }
+            h.seq=ps->seq=(++gen<<12)|(uint32_t)(ps-slots); h.stripe=s; h.block=pd; h.off=(uint32_t)(piece*(long long)g->fs); h.len=(uint32_t)plen; h.total=(uint32_t)blk_len(g,b0);
+            ps->len=frame_seal(ps->frame,&h,par,plen); ps->busy=1; ps->tries=0; ps->sent=ps->first=now_sec(); inflight[pd]++; fl[pd]->sent++;
+            mm_push(mm,iov,&nq,ps->frame,ps->len,&m->d[pd].addr);
+            if((++piece)*(long long)g->fs>=(long long)blk_len(g,b0)){ s++; piece=0; }
+        }
+        for(int sent=0;sent<nq;){ int r=sendmmsg(cs,mm+sent,nq-sent,0); if(r<=0) break; sent+=r; }
+        int active=0; for(int d=0;d<n;d++) active+=inflight[d];
+        if(!active&&s>=g->nstripe) break;
+        // drain ACKs
+        struct pollfd pfd={cs,POLLIN,0};
+        if(poll(&pfd,1,(int)(BP_RTO_MIN*1000/2))>0){
+            unsigned char ab[sizeof(BinHdr)+4*64]; ssize_t r; uint32_t seqs[64];
+            while((r=recv(cs,ab,sizeof(ab),MSG_DONTWAIT))>=(ssize_t)sizeof(BinHdr)){
+                BinHdr a; memcpy(&a,ab,sizeof(a)); bp_swap(&a);
+                if(a.magic!=BP_MAGIC||a.op!=BP_ACK) continue;
+                double t=now_sec();
+                for(int k=0,ns=bp_ack_seqs(&a,ab,(size_t)r,seqs,64);k<ns;k++){
+                    uint32_t gi=seqs[k]&0xfff; if(gi>=(uint32_t)(n*window)) continue;
+                    Slot *sl=&slots[gi]; if(!sl->busy||sl->seq!=seqs[k]) continue;
+                    if(a.status==BP_E_CSUM){ sl->sent=0; continue; }
+                    if(a.status!=BP_OK){ fprintf(stderr,"copy: disk %s refused block (status %u)\n",m->d[gi/window].name,a.status); rc=-1; goto out; }
+                    sl->busy=0; inflight[gi/window]--; bp_flow_ack(fl[gi/window],sl->tries?-1:t-sl->sent);
+                }
+            }
+        }
+        // retransmit fragments whose ACK is overdue
+        double t=now_sec();
+        if(t-renew->last>=renew->every){ sendto(renew->s,renew->cmd,strlen(renew->cmd),0,(const struct sockaddr*)renew->mgr,sizeof(*renew->mgr)); renew->last=t; }
+        for(int i=0;i<n*window;i++){
+            Slot *sl=&slots[i]; BpFlow *f=fl[i/window]; if(!sl->busy||t-sl->sent<f->rto) continue;
+            if(++sl->tries>RETRY_MAX||t-sl->first>GIVEUP_SEC){ fprintf(stderr,"copy: disk %s not answering\n",m->d[i/window].name); rc=-1; goto out; }
+            sendto(cs,sl->frame,sl->len,0,(const struct sockaddr*)&m->d[i/window].addr,sizeof(m->d[i/window].addr));
+            sl->sent=t; (*retx)++; bp_flow_timeout(f,t);
+        }
+    }
+out:
+    free(slots); free(inflight); return rc;
+}
+
+static void do_copy(int s, const struct sockaddr_in *mgr, int cs, const char *uname, const char *line){
+    char path[512]="",dss[64]="",tmp[32]=""; int window=32;
+    kvget(line,"file",path,sizeof(path)); kvget(line,"dss",dss,sizeof(dss));
+    if(kvget(line,"window",tmp,sizeof(tmp))) window=atoi(tmp);
+    if(!path[0]){ printf("FAILURE usage: copy file=<local-path> dss=<dss> [window=N]\n"); return; }
+    if(window<1) window=1;
+    if(window>64) window=64;
+    int fd=open(path,O_RDONLY); if(fd<0){ perror(path); return; }
+    struct stat sb; if(fstat(fd,&sb)<0){ perror("fstat"); close(fd); return; }
+    const char *base=strrchr(path,'/'); base=base?base+1:path;
+    char cmd[1024], reply[16384]; DiskMap m;
+    snprintf(cmd,sizeof(cmd),"copy file=%s size=%lld owner=%s%s%s\n",base,(long long)sb.st_size,uname,dss[0]?" dss=":"",dss);
+    if(mgr_request(s,mgr,cmd,reply,sizeof(reply))<0){ close(fd); return; }
+    // the SUCCESS fields first: parse_disk_map splits reply into lines
+    unsigned long long lease=0; double ttl=30; char *q;
+    if((q=strstr(reply,"|DSS="))) sscanf(q+5,"%63[^|\n]",dss);
+    if((q=strstr(reply,"|lease="))) lease=strtoull(q+7,NULL,10);
+    if((q=strstr(reply,"|ttl="))&&atof(q+5)>0) ttl=atof(q+5);
+    if(parse_disk_map(reply,&m)<0||m.n<3){ printf("FAILURE bad disk map from manager\n"); close(fd); return; }
+    char rcmd[512]; snprintf(rcmd,sizeof(rcmd),"lease-renew dss=%s file=%s owner=%s lease=%llu\n",dss,base,uname,lease);
+    Renew rn={s,mgr,rcmd,ttl/3,now_sec()};
+    Geo g; geo_init(&g,m.n,(size_t)m.su,(long long)sb.st_size);
+    long long retx=0; double t0=now_sec();
+    int rc=copy_engine(cs,fd,&g,dss,base,&m,window,&rn,&retx);
+    double el=now_sec()-t0; close(fd);
+    if(rc<0){
+        snprintf(cmd,sizeof(cmd),"copy-abort dss=%s file=%s owner=%s lease=%llu\n",dss,base,uname,lease);
+        mgr_call(s,mgr,cmd,reply,sizeof(reply),0);
+        printf("FAILURE copy of %s aborted\n",base); return;
+    }
+    printf("copy: %lld bytes to %d disks (%d data + parity) in %.3f s (%.1f MB/s), %lld retransmits\n",(long long)sb.st_size,m.n,m.n-1,el,el>0?sb.st_size/el/1e6:0.0,retx);
+    snprintf(cmd,sizeof(cmd),"copy-complete dss=%s file=%s owner=%s size=%lld lease=%llu\n",dss,base,uname,(long long)sb.st_size,lease);
+    mgr_request(s,mgr,cmd,reply,sizeof(reply));
+}
+
+// read engine: the file is cut into data fragments in file order (fragment f = piece f%fpb
+// of data block f/fpb) and every disk keeps up to `depth` READs for its own fragments in
+// flight. DATA lands in a ring of RING fragments at f%RING and the contiguous prefix is
+// written out in order, so stdout works as well as a file; nothing is requested more than
+// RING fragments ahead of the written prefix, which bounds memory.
+// degraded mode: a disk that answers "no such block" or stops answering is marked failed
+// (at most one per read). until one has failed, an overdue READ is resent every
+// FAIL_SEC/FAIL_TRIES at most, however far its disk's RTO has backed off, so a dead disk is
+// found in about FAIL_SEC. each of its fragments is then rebuilt by reading the same piece
+// of the stripe from the other n-1 disks and XORing them into the ring entry.
+// a block a disk reports as corrupt (BP_E_CSUM, answered on its first fragment) is rebuilt the
+// same way, all of its fragments, while the disk stays in use for the rest of the file.
+#define RECV_BATCH 16
+#define FAIL_TRIES 3
+#define FAIL_SEC 0.5
+typedef struct { int busy, xor; uint32_t seq; int tries; double sent, first; long long frag; uint32_t off, want; size_t len; unsigned char frame[sizeof(BinHdr)+128]; } RSlot;
+typedef struct { long long s, piece; } RCursor;
+typedef struct { long long f; int d; } Redo; // fragment f of disk d, to rebuild from the others
+static int blk_listed(const long long *v, int n, long long b){ for(int i=0;i<n;i++) if(v[i]==b) return 1; return 0; }
+
+// next data fragment stored on disk d at or after cursor c (-1 when the disk has no more)
+static long long disk_next_frag(const Geo *g, int d, RCursor *c){
+    for(;c->s<g->nstripe;c->s++,c->piece=0){
+        int j=data_index(g,c->s,d); if(j==g->n-1) continue;
+        long long b=c->s*(g->n-1)+j;
+        if(c->piece*(long long)g->fs<(long long)blk_len(g,b)) return b*g->fpb+c->piece;
+    }
+    return -1;
+}
+static RSlot* rfree_slot(RSlot *slots, int d, int depth){ for(int i=0;i<depth;i++) if(!slots[d*depth+i].busy) return &slots[d*depth+i]; return NULL; }
+
+typedef struct {
+    int cs; const Geo *g; const DiskMap *m; const char *dss, *fname; int depth;
+    RSlot *slots; int *inflight; uint32_t gen; BpFlow *fl[DISKS_MAX];
+    unsigned char *rbuf; size_t *flen; int *pending; long long ring;
+    struct mmsghdr mm[64]; struct iovec iov[64]; int nq;
+} ReadCtx;
+
+static void rd_issue(ReadCtx *x, RSlot *sl, int d, long long s, long long piece, long long f, int xor){
+    BinHdr h; frame_start(sl->frame,&h,BP_READ,x->dss,x->fname);
+    h.seq=sl->seq=(++x->gen<<12)|(uint32_t)(sl-x->slots); h.stripe=s; h.block=d; h.off=(uint32_t)(piece*(long long)x->g->fs); h.len=(uint32_t)x->g->fs;
+    // the exact reply expected: that piece of the block d holds in stripe s (parity is as long as the stripe's first block)
+    int j=data_index(x->g,s,d); sl->off=h.off; sl->want=(uint32_t)frag_len(x->g,s*(x->g->n-1)+(j<x->g->n-1?j:0),piece);
+    sl->len=frame_seal(sl->frame,&h,NULL,0); sl->busy=1; sl->xor=xor; sl->tries=0; sl->frag=f; sl->sent=sl->first=now_sec(); x->inflight[d]++; x->fl[d]->sent++;
+    mm_push(x->mm,x->iov,&x->nq,sl->frame,sl->len,&x->m->d[d].addr);
+    if(x->nq==64){ sendmmsg(x->cs,x->mm,x->nq,0); x->nq=0; }
+}
+// rebuild fragment f of disk `failed` from the rest of its stripe; 0 if not enough room yet
+static int rd_rebuild(ReadCtx *x, long long f, int failed){
+    const Geo *g=x->g; long long b=f/g->fpb, piece=f%g->fpb, s=b/(g->n-1);
+    for(int d=0;d<g->n;d++) if(d!=failed&&!rfree_slot(x->slots,d,x->depth)) return 0;
+    long long r=f%x->ring; memset(x->rbuf+(size_t)r*g->fs,0,g->fs); x->flen[r]=frag_len(g,b,piece); x->pending[r]=0;
+    for(int d=0;d<g->n;d++){
+        if(d==failed) continue;
+        int j=data_index(g,s,d);
+        if(j<g->n-1&&!frag_len(g,s*(g->n-1)+j,piece)) continue; // beyond the file: counts as zeros
+        rd_issue(x,rfree_slot(x->slots,d,x->depth),d,s,piece,f,1); x->pending[r]++;
+    }
+    return 1;
+}
+
+static int read_engine(int cs, int out, const Geo *g, const char *dss, const char *fname, const DiskMap *m, int depth, long long *retx, int *failed_out){
+    int n=g->n; long long ring=(long long)n*depth*4; if(ring<64) ring=64;
+    ReadCtx x; memset(&x,0,sizeof(x)); x.cs=cs; x.g=g; x.m=m; x.dss=dss; x.fname=fname; x.depth=depth; x.ring=ring;
+    x.rbuf=malloc((size_t)ring*g->fs); x.flen=calloc((size_t)ring,sizeof(size_t)); x.pending=calloc((size_t)ring,sizeof(int));
+    x.slots=calloc((size_t)n*depth,sizeof(RSlot)); x.inflight=calloc((size_t)n,sizeof(int));
+    unsigned char *done=calloc((size_t)ring,1), *rx=malloc((size_t)RECV_BATCH*DGRAM_RX);
+    RCursor *cur=calloc((size_t)n,sizeof(RCursor)); Redo *redo=malloc((size_t)(ring+depth)*sizeof(Redo)); int nredo=0;
+    long long *bad=NULL; int nbad=0; // data blocks a disk found corrupt: read through parity
+    int rc=0, failed=-1; long long flushed=0;
+    for(int d=0;d<n;d++) x.fl[d]=peer_flow(m->d[d].name,depth);
+    if(!x.rbuf||!x.flen||!x.pending||!x.slots||!x.inflight||!done||!rx||!cur||!redo){ rc=-1; goto out; }
+    while(flushed<g->nfrag){
+        // rebuild the fragments that need it first (they hold up the prefix), then the failed
+        // disk's, then issue READs for every other disk within the ring horizon
+        while(nredo>0&&rd_rebuild(&x,redo[nredo-1].f,redo[nredo-1].d)) nredo--;
+        if(failed>=0){
+            long long f;
+            while(!nredo&&(f=disk_next_frag(g,failed,&cur[failed]))>=0&&f<flushed+ring&&rd_rebuild(&x,f,failed)) cur[failed].piece++;
+        }
+        for(int d=0;d<n;d++){
+            if(d==failed) continue;
+            long long f; RSlot *sl;
+            while(x.inflight[d]<bp_flow_window(x.fl[d])&&(f=disk_next_frag(g,d,&cur[d]))>=0&&f<flushed+ring){
+                if(nbad&&blk_listed(bad,nbad,f/g->fpb)){ if(!rd_rebuild(&x,f,d)) break; }
+                else if((sl=rfree_slot(x.slots,d,depth))) rd_issue(&x,sl,d,cur[d].s,cur[d].piece,f,0);
+                else break;
+                cur[d].piece++;
+            }
+        }
+        if(x.nq){ sendmmsg(cs,x.mm,x.nq,0); x.nq=0; }
+        // take in a batch of DATA replies
+        struct pollfd pfd={cs,POLLIN,0};
+        int lost=-1;
+        if(poll(&pfd,1,(int)(BP_RTO_MIN*1000/2))>0){
+            struct mmsghdr rm[RECV_BATCH]; struct iovec riov[RECV_BATCH]; double t=now_sec();
+            for(int i=0;i<RECV_BATCH;i++){ riov[i].iov_base=rx+(size_t)i*DGRAM_RX; riov[i].iov_len=DGRAM_RX; memset(&rm[i],0,sizeof(rm[i])); rm[i].msg_hdr.msg_iov=&riov[i]; rm[i].msg_hdr.msg_iovlen=1; }
+            int got=recvmmsg(cs,rm,RECV_BATCH,MSG_DONTWAIT,NULL);
+            for(int i=0;i<got;i++){
+                unsigned char *p=riov[i].iov_base; size_t len=rm[i].msg_len; if(len<sizeof(BinHdr)) continue;
+                BinHdr a; memcpy(&a,p,sizeof(a)); bp_swap(&a);
+                if(a.magic!=BP_MAGIC||a.op!=BP_DATA) continue;
+                uint32_t gi=a.seq&0xfff; if(gi>=(uint32_t)(n*depth)) continue;
+                RSlot *sl=&x.slots[gi]; if(!sl->busy||sl->seq!=a.seq) continue;
+                int d=(int)(gi/depth);
+                if(a.status==BP_E_NOENT){ if(lost<0) lost=d; continue; }
+                if(a.status==BP_E_CSUM){
+                    // a corrupt block: read all of it through parity. a second bad member of the stripe can't be
+                    if(sl->xor||(failed>=0&&failed!=d)){ fprintf(stderr,"read: disk %s has a corrupt block in a stripe already missing a member\n",m->d[d].name); rc=-1; goto out; }
+                    long long b=sl->frag/g->fpb; sl->busy=0; x.inflight[d]--;
+                    if(blk_listed(bad,nbad,b)){ done[sl->frag%ring]=0; redo[nredo++]=(Redo){sl->frag,d}; continue; }
+                    long long *nb=realloc(bad,(size_t)(nbad+1)*sizeof(*bad)); if(!nb){ rc=-1; goto out; }
+                    bad=nb; bad[nbad++]=b;
+                    fprintf(stderr,"read: block %lld on disk %s fails its checksum, rebuilding it from parity\n",b,m->d[d].name);
+                    // its fragments already asked for (in flight or in): cancel and rebuild; the rest are rebuilt when issued
+                    for(long long f=b*g->fpb;f<(b+1)*g->fpb&&f<flushed+ring;f++){
+                        long long piece=f%g->fpb; if(f<flushed||!frag_len(g,b,piece)) continue;
+                        long long s=b/(g->n-1); if(s>cur[d].s||(s==cur[d].s&&piece>=cur[d].piece)) break;
+                        if(f!=sl->frag) for(int k=0;k<depth;k++){ RSlot *o=&x.slots[d*depth+k]; if(o->busy&&!o->xor&&o->frag==f){ o->busy=0; x.inflight[d]--; } }
+                        done[f%ring]=0; redo[nredo++]=(Redo){f,d};
+                    }
+                    continue;
+                }
+                if(a.status!=BP_OK){ fprintf(stderr,"read: disk %s refused a READ (status %u)\n",m->d[d].name,a.status); rc=-1; goto out; }
+                if(a.len!=sl->want||a.off!=sl->off||a.len>len-sizeof(a)||((a.flags&BP_F_CSUM)&&crc32c(0,p+sizeof(a),a.len)!=a.csum)){ sl->sent=0; continue; } // not what was asked for, or damaged: resend
+                long long r=sl->frag%ring; unsigned char *dst=x.rbuf+(size_t)r*g->fs;
+                if(sl->xor){ xor_into(dst,p+sizeof(a),a.len); if(--x.pending[r]==0) done[r]=1; }
+                else{ memcpy(dst,p+sizeof(a),a.len); x.flen[r]=a.len; done[r]=1; }
+                sl->busy=0; x.inflight[d]--; bp_flow_ack(x.fl[d],sl->tries?-1:t-sl->sent);
+            }
+        }
+        double t=now_sec();
+        for(int i=0;i<n*depth&&lost<0;i++){
+            RSlot *sl=&x.slots[i]; BpFlow *f=x.fl[i/depth];
+            double wait=failed<0&&f->rto>FAIL_SEC/FAIL_TRIES?FAIL_SEC/FAIL_TRIES:f->rto; // detection doesn't back off
+            if(!sl->busy||t-sl->sent<wait) continue;
+            if(++sl->tries>(failed<0?FAIL_TRIES:RETRY_MAX)&&t-sl->first>=(failed<0?FAIL_SEC:GIVEUP_SEC)){ lost=i/depth; break; }
+            sendto(cs,sl->frame,sl->len,0,(const struct sockaddr*)&m->d[i/depth].addr,sizeof(m->d[i/depth].addr));
+            sl->sent=t; (*retx)++; bp_flow_timeout(f,t);
+        }
+        if(lost>=0){
+            if(failed>=0){ fprintf(stderr,"read: disk %s lost as well, more than one failure in the array\n",m->d[lost].name); rc=-1; goto out; }
+            failed=lost; fprintf(stderr,"read: disk %s unavailable, reconstructing its blocks from parity\n",m->d[lost].name);
+            for(int i=0;i<depth;i++){ RSlot *sl=&x.slots[failed*depth+i]; if(!sl->busy) continue; sl->busy=0; x.inflight[failed]--; redo[nredo++]=(Redo){sl->frag,failed}; }
+        }
+        // write out the in-order prefix
+        while(flushed<g->nfrag&&done[flushed%ring]){
+            long long r=flushed%ring; size_t w=0;
+            while(w<x.flen[r]){ ssize_t k=write(out,x.rbuf+(size_t)r*g->fs+w,x.flen[r]-w); if(k<=0){ perror("write"); rc=-1; goto out; } w+=(size_t)k; }
+            done[r]=0; flushed++;
+        }
+    }
+out:
+    if(failed_out) *failed_out=failed;
+    free(x.rbuf); free(x.flen); free(x.pending); free(x.slots); free(x.inflight); free(done); free(rx); free(cur); free(redo); free(bad);
+    return rc;
+}
+
+static void do_read(int s, const struct sockaddr_in *mgr, int cs, const char *uname, const char *line){
+    char fname[64]="",dss[64]="",path[512]="",tmp[32]=""; int depth=16;
+    kvget(line,"file",fname,sizeof(fname)); kvget(line,"dss",dss,sizeof(dss));
+    int explicit_out=kvget(line,"out",path,sizeof(path))!=NULL;
+    if(kvget(line,"depth",tmp,sizeof(tmp))) depth=atoi(tmp);
+    if(!fname[0]||!dss[0]){ printf("FAILURE usage: read file=<name> dss=<dss> [out=<path>|-] [depth=N]\n"); return; }
+    if(depth<1) depth=1;
+    if(depth>64) depth=64;
+    if(!explicit_out) snprintf(path,sizeof(path),"%s",fname);
+    char cmd[1024], reply[16384]; DiskMap m;
+    snprintf(cmd,sizeof(cmd),"read dss=%s file=%s user=%s\n",dss,fname,uname);
+    if(mgr_request(s,mgr,cmd,reply,sizeof(reply))<0) return;
+    char *sz=strstr(reply,"|size="); long long fsize=sz?atoll(sz+6):-1;
+    if(parse_disk_map(reply,&m)<0||m.n<3||fsize<0){ printf("FAILURE bad disk map from manager\n"); return; }
+    // don't clobber a local file unless asked to (it may be the copy source)
+    int out=strcmp(path,"-")==0?STDOUT_FILENO:open(path,O_WRONLY|O_CREAT|(explicit_out?O_TRUNC:O_EXCL),0644);
+    Geo g; geo_init(&g,m.n,(size_t)m.su,fsize);
+    long long retx=0; int rc=-1, failed=-1; double t0=now_sec();
+    if(out<0) perror(path);
+    else rc=read_engine(cs,out,&g,dss,fname,&m,depth,&retx,&failed);
+    double el=now_sec()-t0;
+    if(out>=0&&out!=STDOUT_FILENO) close(out);
+    if(rc==0) fprintf(out==STDOUT_FILENO?stderr:stdout,"read: %lld bytes from %d disks in %.3f s (%.1f MB/s), %lld retransmits%s%s\n",fsize,m.n,el,el>0?fsize/el/1e6:0.0,retx,failed>=0?", degraded without ":"",failed>=0?m.d[failed].name:"");
+    else printf("FAILURE read of %s aborted\n",fname);
+    snprintf(cmd,sizeof(cmd),"read-complete dss=%s file=%s user=%s\n",dss,fname,uname);
+    mgr_request(s,mgr,cmd,reply,sizeof(reply));
+}
+
+// rebuild engine: recreates every block the failed disk held (data and parity) from the
+// other n-1 disks and writes it back to the replacement disk at the same position. work is
+// cut into units of one fragment; a unit READs that piece of the stripe from each survivor,
+// XORs the answers into its WRITE frame, sends the WRITE and is recycled on the ACK, so
+// memory stays at `depth` units however large the DSS is. a unit only starts when every disk
+// it touches has room in its congestion window (a unit counts against the replacement disk
+// from start to ACK), and timers follow each disk's RTO. rate=<MB/s> caps the rebuilt
+// bytes per second to leave room for foreground reads; progress goes to the manager as
+// "recovery-progress" every PROGRESS_SEC.
+#define PROGRESS_SEC 0.5
+typedef struct { char name[64]; long long size; } RebFile;
+typedef struct { int busy, pending, file; long long s, piece; RSlot rd[DISKS_MAX]; Slot wr; BinHdr h; unsigned char *acc; } RUnit;
+typedef struct { int file; long long s, piece; } RebCursor;
+
+// target of the next unit: the next piece the failed disk held, in file/stripe order
+static size_t reb_next(const RebFile *files, int nfiles, const DiskMap *m, int failed, RebCursor *c, Geo *g){
+    for(;c->file<nfiles;c->file++,c->s=0,c->piece=0){
+        geo_init(g,m->n,(size_t)m->su,files[c->file].size);
+        for(;c->s<g->nstripe;c->s++,c->piece=0){
+            int j=data_index(g,c->s,failed);
+            size_t len=frag_len(g,c->s*(g->n-1)+(j==g->n-1?0:j),c->piece);
+            if(len) return len;
+        }
+    }
+    return 0;
+}
+static long long reb_total(const RebFile *files, int nfiles, const DiskMap *m, int failed){
+    long long t=0; Geo g;
+    for(int f=0;f<nfiles;f++){
+        geo_init(&g,m->n,(size_t)m->su,files[f].size);
+        for(long long s=0;s<g.nstripe;s++){ int j=data_index(&g,s,failed); t+=(long long)blk_len(&g,s*(g.n-1)+(j==g.n-1?0:j)); }
+    }
+    return t;
+}
+
+static int rebuild_engine(int cs, int ms, const struct sockaddr_in *mgr, const char *dss, const RebFile *files, int nfiles, const DiskMap *m, int failed, int depth, double rate, long long *done_out, long long *retx){
+    int n=m->n; if(depth*n>4096) depth=4096/n;
+    RUnit *u=calloc((size_t)depth,sizeof(RUnit)); unsigned char *rx=malloc((size_t)RECV_BATCH*DGRAM_RX);
+    if(!u||!rx){ free(u); free(rx); return -1; }
+    long long total=reb_total(files,nfiles,m,failed), issued=0, done=0; RebCursor cur={0,0,0}; Geo g;
+    uint32_t gen=0; int rc=0, active=0, inflight[DISKS_MAX]={0}; double t0=now_sec(), last_report=t0;
+    BpFlow *fl[DISKS_MAX]; for(int d=0;d<n;d++) fl[d]=peer_flow(m->d[d].name,depth);
+    struct mmsghdr mm[64]; struct iovec iov[64];
+    for(;;){
+        // start units while there is room, work left and the rate allows
+        int nq=0; size_t len;
+        for(;;){
+            int room=active<depth&&nq+n<=64&&(rate<=0||issued<=rate*1e6*(now_sec()-t0));
+            for(int d=0;d<n&&room;d++) if(inflight[d]>=bp_flow_window(fl[d])) room=0;
+            if(!room||!(len=reb_next(files,nfiles,m,failed,&cur,&g))) break;
+            int ui=0; while(u[ui].busy) ui++;
+            RUnit *x=&u[ui]; const char *fname=files[cur.file].name; int j=data_index(&g,cur.s,failed);
+            x->busy=1; x->pending=0; x->file=cur.file; x->s=cur.s; x->piece=cur.piece; x->wr.busy=0;
+            x->acc=frame_start(x->wr.frame,&x->h,BP_WRITE,dss,fname); memset(x->acc,0,len);
+            x->h.stripe=cur.s; x->h.block=failed; x->h.off=(uint32_t)(cur.piece*(long long)g.fs); x->h.len=(uint32_t)len;
+            x->h.total=(uint32_t)blk_len(&g,cur.s*(n-1)+(j==n-1?0:j));
+            for(int d=0;d<n;d++){
+                if(d==failed) continue;
+                int jd=data_index(&g,cur.s,d);
+                if(jd<n-1&&!frag_len(&g,cur.s*(n-1)+jd,cur.piece)) continue; // beyond the file: zeros
+                RSlot *sl=&x->rd[d]; BinHdr h; frame_start(sl->frame,&h,BP_READ,dss,fname);
+                h.seq=sl->seq=(++gen<<12)|(uint32_t)(ui*n+d); h.stripe=cur.s; h.block=d; h.off=x->h.off; h.len=(uint32_t)g.fs;
+                sl->len=frame_seal(sl->frame,&h,NULL,0); sl->busy=1; sl->tries=0; sl->sent=sl->first=now_sec(); x->pending++; inflight[d]++; fl[d]->sent++;
+                mm_push(mm,iov,&nq,sl->frame,sl->len,&m->d[d].addr);
+            }
+            active++; inflight[failed]++; issued+=(long long)len; cur.piece++;
+        }
+        for(int sent=0;sent<nq;){ int r=sendmmsg(cs,mm+sent,nq-sent,0); if(r<=0) break; sent+=r; }
+        if(!active&&!reb_next(files,nfiles,m,failed,&cur,&g)) break;
+        // READ answers fold into their unit; a complete unit sends its WRITE; the ACK frees it
+        struct pollfd pfd={cs,POLLIN,0};
+        if(poll(&pfd,1,(int)(BP_RTO_MIN*1000/2))>0){
+            struct mmsghdr rm[RECV_BATCH]; struct iovec riov[RECV_BATCH]; double t=now_sec();
+            for(int i=0;i<RECV_BATCH;i++){ riov[i].iov_base=rx+(size_t)i*DGRAM_RX; riov[i].iov_len=DGRAM_RX; memset(&rm[i],0,sizeof(rm[i])); rm[i].msg_hdr.msg_iov=&riov[i]; rm[i].msg_hdr.msg_iovlen=1; }
+            int got=recvmmsg(cs,rm,RECV_BATCH,MSG_DONTWAIT,NULL);
+            for(int i=0;i<got;i++){
+                unsigned char *p=riov[i].iov_base; size_t rl=rm[i].msg_len; if(rl<sizeof(BinHdr)) continue;
+                BinHdr a; memcpy(&a,p,sizeof(a)); bp_swap(&a);
+                uint32_t gi=a.seq&0xfff; if(a.magic!=BP_MAGIC||gi>=(uint32_t)(depth*n)) continue;
+                RUnit *x=&u[gi/n]; int d=(int)(gi%n); if(!x->busy) continue;
+                if(a.op==BP_ACK&&d==failed&&x->wr.busy&&x->wr.seq==a.seq){
+                    if(a.status==BP_E_CSUM){ x->wr.sent=0; continue; }
+                    if(a.status!=BP_OK){ fprintf(stderr,"recovery: disk %s refused block (status %u)\n",m->d[d].name,a.status); rc=-1; goto out; }
+                    x->busy=0; active--; inflight[failed]--; bp_flow_ack(fl[failed],x->wr.tries?-1:t-x->wr.sent); done+=x->h.len; continue;
+                }
+                RSlot *sl=&x->rd[d]; if(a.op!=BP_DATA||d==failed||!sl->busy||sl->seq!=a.seq) continue;
+                if(a.status!=BP_OK){ fprintf(stderr,"recovery: disk %s has no stripe %lld block %d, cannot rebuild\n",m->d[d].name,x->s,d); rc=-1; goto out; }
+                if(a.len>rl-sizeof(a)||((a.flags&BP_F_CSUM)&&crc32c(0,p+sizeof(a),a.len)!=a.csum)){ sl->sent=0; continue; }
+                xor_into(x->acc,p+sizeof(a),a.len<x->h.len?a.len:x->h.len); sl->busy=0; inflight[d]--; bp_flow_ack(fl[d],sl->tries?-1:t-sl->sent);
+                if(--x->pending==0){
+                    x->h.seq=x->wr.seq=(++gen<<12)|(uint32_t)((x-u)*n+failed);
+                    x->wr.len=frame_seal(x->wr.frame,&x->h,x->acc,x->h.len); x->wr.busy=1; x->wr.tries=0; x->wr.sent=x->wr.first=now_sec(); fl[failed]->sent++;
+                    sendto(cs,x->wr.frame,x->wr.len,0,(const struct sockaddr*)&m->d[failed].addr,sizeof(m->d[failed].addr));
+                }
+            }
+        }
+        double t=now_sec();
+        for(int ui=0;ui<depth;ui++){
+            RUnit *x=&u[ui]; if(!x->busy) continue;
+            for(int d=0;d<n;d++){
+                int *busy=d==failed?&x->wr.busy:&x->rd[d].busy; double *sent=d==failed?&x->wr.sent:&x->rd[d].sent, first=d==failed?x->wr.first:x->rd[d].first; int *tries=d==failed?&x->wr.tries:&x->rd[d].tries;
+                if(!*busy||t-*sent<fl[d]->rto) continue;
+                if(++*tries>RETRY_MAX||t-first>GIVEUP_SEC){ fprintf(stderr,"recovery: disk %s not answering\n",m->d[d].name); rc=-1; goto out; }
+                if(d==failed) sendto(cs,x->wr.frame,x->wr.len,0,(const struct sockaddr*)&m->d[d].addr,sizeof(m->d[d].addr));
+                else sendto(cs,x->rd[d].frame,x->rd[d].len,0,(const struct sockaddr*)&m->d[d].addr,sizeof(m->d[d].addr));
+                *sent=t; (*retx)++; bp_flow_timeout(fl[d],t);
+            }
+        }
+        if(t-last_report>=PROGRESS_SEC){
+            char msg[256]; int k=snprintf(msg,sizeof(msg),"recovery-progress dss=%s disk=%s done=%lld total=%lld mbps=%.1f\n",dss,m->d[failed].name,done,total,done/(t-t0)/1e6);
+            sendto(ms,msg,(size_t)k,0,(const struct sockaddr*)mgr,sizeof(*mgr));
+            char junk[512]; while(recv(ms,junk,sizeof(junk),MSG_DONTWAIT)>0){} // its SUCCESS, not ours to print
+            fprintf(stderr,"recovery: %lld/%lld bytes (%.0f%%), %.1f MB/s\n",done,total,total?100.0*done/total:100.0,done/(t-t0)/1e6);
+            last_report=t;
+        }
+    }
+out:
+    *done_out=done; free(u); free(rx); return rc;
+}
+
+// wipe a disk with FAIL|id=<n> and wait for its FAILED|id=<n>, resending every RTO_SEC;
+// -1 when it never answers
+static int disk_wipe(int cs, const struct sockaddr_in *addr){
+    unsigned long long id=((unsigned long long)getpid()<<32)^(unsigned long long)(now_sec()*1e6); if(!id) id=1;
+    char req[64], want[64]; int rl=snprintf(req,sizeof(req),"FAIL|id=%llu",id); snprintf(want,sizeof(want),"FAILED|id=%llu\n",id);
+    for(int t=0;t<RETRY_MAX;t++){
+        sendto(cs,req,(size_t)rl,0,(const struct sockaddr*)addr,sizeof(*addr));
+        for(double until=now_sec()+RTO_SEC,t1;(t1=now_sec())<until;){
+            struct pollfd pf={cs,POLLIN,0}; if(poll(&pf,1,(int)((until-t1)*1000)+1)<=0) continue;
+            char b[128]; ssize_t k=recv(cs,b,sizeof(b)-1,MSG_DONTWAIT); if(k<=0) continue;
+            b[k]='\0'; if(!strcmp(b,want)) return 0; // anything else is a stray reply from earlier traffic
+        }
+    }
+    return -1;
+}
+
+// disk-failure dss=<dss> [disk=<name>] [rate=<MB/s>] [depth=N]: the manager names the failed
+// disk (or takes ours) and lists the files; the disk is wiped with FAIL| (acknowledged) to stand
+// in for a blank replacement, rebuilt from parity, and the result reported with recovery-complete
+static void do_fail(int s, const struct sockaddr_in *mgr, int cs, const char *line){
+    char dss[64]="",disk[64]="",tmp[32]=""; int depth=16; double rate=0;
+    kvget(line,"dss",dss,sizeof(dss)); kvget(line,"disk",disk,sizeof(disk));
+    if(kvget(line,"depth",tmp,sizeof(tmp))) depth=atoi(tmp);
+    if(kvget(line,"rate",tmp,sizeof(tmp))) rate=atof(tmp);
+    if(!dss[0]){ printf("FAILURE usage: disk-failure dss=<dss> [disk=<name>] [rate=<MB/s>] [depth=N]\n"); return; }
+    if(depth<1) depth=1;
+    if(depth>64) depth=64;
+    char cmd[512]; static char reply[65536]; DiskMap m;
+    snprintf(cmd,sizeof(cmd),"disk-failure dss=%s%s%s\n",dss,disk[0]?" disk=":"",disk);
+    if(mgr_request(s,mgr,cmd,reply,sizeof(reply))<0) return;
+    int nfiles=0; for(const char *p=reply;(p=strstr(p,"FILE|"));p++) nfiles++;
+    RebFile *files=calloc((size_t)nfiles+1,sizeof(RebFile)); int failed=-1; nfiles=0;
+    if(!files) return;
+    for(char *l=reply;l&&*l;){
+        char *nl=strchr(l,'\n'); if(nl) *nl='\0';
+        if(!strncmp(l,"FILE|",5)&&kvget(l,"name",files[nfiles].name,sizeof(files[nfiles].name))&&kvget(l,"size",tmp,sizeof(tmp))) files[nfiles++].size=atoll(tmp);
+        if(!strncmp(l,"SUCCESS|",8)&&kvget(l,"failed",tmp,sizeof(tmp))) failed=atoi(tmp);
+        if(nl) *nl='\n';
+        l=nl?nl+1:NULL;
+    }
+    if(parse_disk_map(reply,&m)<0||m.n<3||failed<0||failed>=m.n){ printf("FAILURE bad disk map from manager\n"); free(files); return; }
+    if(disk_wipe(cs,&m.d[failed].addr)<0){ printf("FAILURE disk %s did not acknowledge the wipe, recovery not started\n",m.d[failed].name); free(files); return; }
+    long long done=0, retx=0; double t0=now_sec();
+    int rc=rebuild_engine(cs,s,mgr,dss,files,nfiles,&m,failed,depth,rate,&done,&retx);
+    double el=now_sec()-t0; free(files);
+    if(rc<0){ printf("FAILURE recovery of %s on %s aborted after %lld bytes\n",m.d[failed].name,dss,done); return; }
+    printf("recovery: rebuilt %lld bytes on %s from %d disks in %.3f s (%.1f MB/s), %lld retransmits\n",done,m.d[failed].name,m.n-1,el,el>0?done/el/1e6:0.0,retx);
+    snprintf(cmd,sizeof(cmd),"recovery-complete dss=%s disk=%s bytes=%lld secs=%.3f\n",dss,m.d[failed].name,done,el);
+    mgr_request(s,mgr,cmd,reply,sizeof(reply));
+}
+
+// ls [dss=<dss>] [owner=<user>] [prefix=<p>] [limit=N]: fetch the listing page by page,
+// following MORE|cursor= until END. a page that came back incomplete is asked for again
+// (pages are idempotent), so output stays complete
+#define LS_TRIES 3
+static void do_ls(int s, const struct sockaddr_in *mgr, const char *line){
+    char base[1024]="ls", args[1024], cursor[64]=""; static char page[65536];
+    snprintf(args,sizeof(args),"%s",line+2);
+    for(char *save=NULL,*t=strtok_r(args," \t\r\n",&save);t;t=strtok_r(NULL," \t\r\n",&save)){
+        if(!strncmp(t,"cursor=",7)){ snprintf(cursor,sizeof(cursor),"%s",t+7); continue; } // we own the cursor
+        strncat(base," ",sizeof(base)-strlen(base)-1); strncat(base,t,sizeof(base)-strlen(base)-1);
+    }
+    long total=0; int pages=0;
+    for(int tries=0;;){
+        char cmd[1200]; snprintf(cmd,sizeof(cmd),"%s%s%s\n",base,cursor[0]?" cursor=":"",cursor);
+        if(mgr_call(s,mgr,cmd,page,sizeof(page),0)<0){
+            if(++tries>LS_TRIES){ printf("FAILURE ls: incomplete page after %d tries\n",LS_TRIES); return; }
+            continue;
+        }
+        char *end=page; int lines=0;
+        while(*end&&strncmp(end,"END|",4)&&strncmp(end,"MORE|",5)&&strncmp(end,"FAILURE",7)){ char *nl=strchr(end,'\n'); end=nl?nl+1:end+strlen(end); lines++; }
+        if(!strncmp(end,"FAILURE",7)||!*end){ fputs(*end?end:"FAILURE ls: no end marker from manager\n",stdout); return; }
+        tries=0; pages++; total+=lines;
+        fwrite(page,1,(size_t)(end-page),stdout);
+        if(!strncmp(end,"END|",4)){ printf("END|entries=%ld|pages=%d\n",total,pages); return; }
+        if(!kvget(end,"cursor",cursor,sizeof(cursor))){ printf("FAILURE ls: bad cursor from manager\n"); return; }
+    }
+}
+
+// stdin without stdio buffering, so poll() on fd 0 tells the truth about pending input
+typedef struct { char buf[8192]; size_t len; int eof; } LineIn;
+static void line_fill(LineIn *in){
+    if(in->len==sizeof(in->buf)) in->len=0; // an over-long line is dropped
+    ssize_t n=read(0,in->buf+in->len,sizeof(in->buf)-in->len);
+    if(n<=0) in->eof=1; else in->len+=(size_t)n;
+}
+// the next whole line (with its '\n'; the last one may lack it at EOF) into out; 0 if none yet
+static int line_take(LineIn *in, char *out, size_t outsz){
+    char *nl=memchr(in->buf,'\n',in->len); size_t n=nl?(size_t)(nl-in->buf)+1:(in->eof?in->len:0);
+    if(!n) return 0;
+    size_t c=n<outsz-2?n:outsz-2; memcpy(out,in->buf,c); out[c]='\0';
+    if(out[c-1]!='\n'){ out[c]='\n'; out[c+1]='\0'; }
+    memmove(in->buf,in->buf+n,in->len-n); in->len-=n; return 1;
 }
 
 int main(int argc, char **argv){
-    nobuf();
+    nobuf(); xor_select();
+    if(argc==2&&!strcmp(argv[1],"--bench-xor")) return bench_xor();
     if(argc!=6){ fprintf(stderr,"usage: user <user-name> <manager-ip> <manager-port> <m-port> <c-port>\n"); return 1; }
     const char *uname=argv[1]; const char *mgr_ip=argv[2]; int mgr_port=atoi(argv[3]); int my_mport=atoi(argv[4]); int my_cport=atoi(argv[5]);
 
@@ -36,28 +818,42 @@ int main(int argc, char **argv){
     struct sockaddr_in me; memset(&me,0,sizeof(me)); me.sin_family=AF_INET; me.sin_addr.s_addr=htonl(INADDR_ANY); me.sin_port=htons(my_mport);
     if(bind(s,(struct sockaddr*)&me,sizeof(me))<0){ perror("bind"); return 1; }
 
+    // c-port: data plane socket towards the disks
+    int cs=socket(AF_INET,SOCK_DGRAM,0); if(cs<0){ perror("socket"); return 1; }
+    setsockopt(cs,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
+    int bufsz=8<<20; setsockopt(cs,SOL_SOCKET,SO_RCVBUF,&bufsz,sizeof(bufsz)); setsockopt(cs,SOL_SOCKET,SO_SNDBUF,&bufsz,sizeof(bufsz));
+    struct sockaddr_in mc=me; mc.sin_port=htons(my_cport);
+    if(bind(cs,(struct sockaddr*)&mc,sizeof(mc))<0){ perror("bind c-port"); return 1; }
+
     struct sockaddr_in mgr; memset(&mgr,0,sizeof(mgr)); mgr.sin_family=AF_INET; mgr.sin_port=htons(mgr_port);
     if(inet_pton(AF_INET,mgr_ip,&mgr.sin_addr)!=1){ fprintf(stderr,"bad manager ip: %s\n",mgr_ip); return 1; }
 
     char my_ip[16]="127.0.0.1"; char reg[256];
     snprintf(reg,sizeof(reg),"REGISTER USER %s %s %d %d\n",uname,my_ip,my_mport,my_cport);
-    if(sendto(s,reg,strlen(reg),0,(struct sockaddr*)&mgr,sizeof(mgr))<0){ perror("sendto"); return 1; }
-    recv_and_print_with_timeout(s,500);
-    recv_and_print_with_timeout(s,500);
-
-    char cmd[1024];
-    while(fgets(cmd,sizeof(cmd),stdin)){
-        if(cmd[0]=='\n') continue;
-        if(cmd[strlen(cmd)-1]!='\n'){ size_t r=sizeof(cmd)-strlen(cmd)-1; if(r>0) strncat(cmd,"\n",r); }
-        if(sendto(s,cmd,strlen(cmd),0,(struct sockaddr*)&mgr,sizeof(mgr))<0){ perror("sendto"); continue; }
+    static char out[4096]; mgr_request(s,&mgr,reg,out,sizeof(out));
 
-        for(;;){
-            struct timeval tv; tv.tv_sec=0; tv.tv_usec=300000;
-            setsockopt(s,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
-            char buf[4096]; ssize_t n=recvfrom(s,buf,sizeof(buf)-1,0,NULL,NULL);
-            if(n<=0) break;
-            buf[n]='\0'; fputs(buf,stdout);
+    // plain commands are pipelined (sent as soon as they are read, replies printed in order
+    // as they complete); copy/read/disk-failure/ls first let the pipeline drain
+    LineIn in={{0},0,0}; char cmd[1024];
+    for(;;){
+        pipe_print();
+        if(npend<PIPE_MAX&&line_take(&in,cmd,sizeof(cmd))){
+            if(cmd[0]=='\n') continue;
+            if(!strncasecmp(cmd,"copy ",5)){ pipe_drain(s); do_copy(s,&mgr,cs,uname,cmd); continue; }
+            if(!strncasecmp(cmd,"read ",5)){ pipe_drain(s); do_read(s,&mgr,cs,uname,cmd); continue; }
+            if(!strncasecmp(cmd,"disk-failure ",13)){ pipe_drain(s); do_fail(s,&mgr,cs,cmd); continue; }
+            if(!strncasecmp(cmd,"ls",2)&&isspace((unsigned char)cmd[2])){ pipe_drain(s); do_ls(s,&mgr,cmd); continue; }
+            if(!strcasecmp(cmd,"netstat\n")){ pipe_drain(s); do_netstat(); continue; }
+            if(!strcasecmp(cmd,"sync\n")){ pipe_drain(s); printf("SYNC\n"); continue; }
+            pipe_send(s,&mgr,cmd);
+            continue;
         }
+        if(in.eof){ if(!npend) break; pipe_pump(s,100); continue; }
+        struct pollfd pf[2]={{s,POLLIN,0},{0,POLLIN,0}};
+        int nf=npend<PIPE_MAX?2:1;
+        if(poll(pf,(nfds_t)nf,npend?100:-1)<0&&errno!=EINTR){ perror("poll"); return 1; }
+        if(pf[0].revents&POLLIN||npend) pipe_pump(s,0);
+        if(nf==2&&pf[1].revents&(POLLIN|POLLHUP)) line_fill(&in);
     }
     return 0;
 }